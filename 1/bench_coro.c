@@ -0,0 +1,862 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "libcoro.h"
+
+/**
+ * Microbenchmarks of libcoro. Run without arguments to execute
+ * all of them, or pass names of the ones to run.
+ */
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+bench_yield_f(void *arg)
+{
+	long count = *(long *)arg;
+	for (long i = 0; i < count; ++i)
+		coro_yield();
+	return 0;
+}
+
+/**
+ * Two coroutines yield to each other. Each yield is a full
+ * context switch, every coro_list round also goes through the
+ * scheduler.
+ */
+static void
+bench_yield(void)
+{
+	long count = 5000000;
+	int coro_count = 2;
+	coro_sched_init();
+	for (int i = 0; i < coro_count; ++i)
+		coro_new(bench_yield_f, &count);
+	uint64_t start = bench_now_ns();
+	struct coro *c;
+	long long switches = 0;
+	while ((c = coro_sched_wait()) != NULL) {
+		switches += coro_switch_count(c);
+		coro_delete(c);
+	}
+	uint64_t elapsed = bench_now_ns() - start;
+	printf("yield: backend %s, %lld switches, %.1f ns per coro_yield()\n",
+	       coro_switch_backend(), switches, (double)elapsed / switches);
+}
+
+static int
+bench_nop_f(void *arg)
+{
+	(void)arg;
+	return 0;
+}
+
+/**
+ * Creation rate. Only the creation is measured, the coroutines are
+ * run and deleted afterwards. The first round maps fresh stacks,
+ * the second one takes them from the stack pool. Then batches of
+ * 1k and 10k, each with one mapping of stacks.
+ */
+static void
+bench_create(void)
+{
+	int count = 1000;
+	coro_sched_init();
+	for (int round = 0; round < 2; ++round) {
+		uint64_t start = bench_now_ns();
+		for (int i = 0; i < count; ++i)
+			coro_new(bench_nop_f, NULL);
+		uint64_t elapsed = bench_now_ns() - start;
+		struct coro *c;
+		while ((c = coro_sched_wait()) != NULL)
+			coro_delete(c);
+		printf("create: backend %s, %s stacks, %d coroutines, "
+		       "%.0f coroutines/s, %.0f ns per coro_new()\n",
+		       coro_switch_backend(), round == 0 ? "new" : "pooled",
+		       count, count * 1e9 / elapsed, (double)elapsed / count);
+	}
+	for (count = 1000; count <= 10000; count *= 10) {
+		uint64_t start = bench_now_ns();
+		coro_new_batch(bench_nop_f, NULL, count, NULL);
+		uint64_t elapsed = bench_now_ns() - start;
+		struct coro *c;
+		while ((c = coro_sched_wait()) != NULL)
+			coro_delete(c);
+		printf("create: backend %s, batch, %d coroutines, "
+		       "%.0f coroutines/s, %.0f ns per coroutine\n",
+		       coro_switch_backend(), count, count * 1e9 / elapsed,
+		       (double)elapsed / count);
+	}
+	coro_sched_destroy();
+}
+
+static int
+bench_short_f(void *arg)
+{
+	(void)arg;
+	coro_yield();
+	return 0;
+}
+
+/**
+ * Scaling of the reaping - a lot of short-lived coroutines, each
+ * yields once and finishes. Up to 20k of them are alive at once -
+ * each stack with its guard page takes two mappings, and the
+ * default vm.max_map_count is 65530. A finished coroutine is
+ * replaced with a new one until the total count is reached. The
+ * cost per coroutine should not depend on the count.
+ */
+static void
+bench_reap(void)
+{
+	int counts[] = {1000, 10000, 100000};
+	int max_alive = 20000;
+	coro_sched_init();
+	for (int k = 0; k < (int)(sizeof(counts) / sizeof(counts[0])); ++k) {
+		int count = counts[k];
+		int spawned = 0, reaped = 0;
+		uint64_t start = bench_now_ns();
+		for (; spawned < count && spawned < max_alive; ++spawned)
+			coro_new_ex(bench_short_f, NULL, 16 * 1024);
+		struct coro *c;
+		while ((c = coro_sched_wait()) != NULL) {
+			++reaped;
+			coro_delete(c);
+			if (spawned < count) {
+				coro_new_ex(bench_short_f, NULL, 16 * 1024);
+				++spawned;
+			}
+		}
+		uint64_t elapsed = bench_now_ns() - start;
+		if (reaped != count) {
+			printf("reap: %d coroutines created, %d reaped\n",
+			       count, reaped);
+			exit(-1);
+		}
+		printf("reap: %d coroutines, %.3f ms total, %.0f ns per "
+		       "coroutine\n", count, elapsed / 1e6,
+		       (double)elapsed / count);
+	}
+}
+
+/**
+ * The multi-threaded scheduler - a bunch of coroutines yielding
+ * on 1, 2, 4 and 8 worker threads.
+ */
+static void
+bench_threads(void)
+{
+	long count = 10000;
+	int coro_count = 1000;
+	for (int threads = 1; threads <= 8; threads *= 2) {
+		coro_sched_init_threads(threads);
+		uint64_t start = bench_now_ns();
+		for (int i = 0; i < coro_count; ++i)
+			coro_new_ex(bench_yield_f, &count, 64 * 1024);
+		struct coro *c;
+		long long switches = 0;
+		int reaped = 0;
+		while ((c = coro_sched_wait()) != NULL) {
+			switches += coro_switch_count(c);
+			++reaped;
+			coro_delete(c);
+		}
+		uint64_t elapsed = bench_now_ns() - start;
+		coro_sched_destroy();
+		if (reaped != coro_count) {
+			printf("threads: %d coroutines created, %d reaped\n",
+			       coro_count, reaped);
+			exit(-1);
+		}
+		printf("threads: %d workers, %lld yields, %.3f ms total, "
+		       "%.1f ns per coro_yield()\n", threads, switches,
+		       elapsed / 1e6, (double)elapsed / switches);
+	}
+}
+
+struct bench_pipe_arg {
+	int in;
+	int out;
+	long count;
+	/** Sends first, the other side only answers. */
+	bool is_initiator;
+};
+
+static int
+bench_pipe_f(void *arg)
+{
+	struct bench_pipe_arg *a = arg;
+	char byte = 0;
+	for (long i = 0; i < a->count; ++i) {
+		if (a->is_initiator && coro_write(a->out, &byte, 1) != 1)
+			return -1;
+		if (coro_read(a->in, &byte, 1) != 1)
+			return -1;
+		if (! a->is_initiator && coro_write(a->out, &byte, 1) != 1)
+			return -1;
+	}
+	return 0;
+}
+
+static int
+bench_offload_f(void *arg)
+{
+	long count = *(long *)arg;
+	char buf[4096];
+	int fd = coro_open("/dev/zero", O_RDONLY, 0);
+	if (fd < 0)
+		return -1;
+	for (long i = 0; i < count; ++i) {
+		if (coro_read(fd, buf, sizeof(buf)) != sizeof(buf))
+			return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+/**
+ * Coroutine I/O. Two coroutines ping-pong a byte over a pair of
+ * non-blocking pipes, parking in the event loop on each read.
+ * Then several coroutines read /dev/zero - a blocking descriptor,
+ * so every read goes through an offload thread.
+ */
+static void
+bench_io(void)
+{
+	long count = 20000;
+	int ping[2], pong[2];
+	if (pipe2(ping, O_NONBLOCK) != 0 || pipe2(pong, O_NONBLOCK) != 0) {
+		printf("io: pipe2 failed\n");
+		exit(-1);
+	}
+	struct bench_pipe_arg a = {pong[0], ping[1], count, true};
+	struct bench_pipe_arg b = {ping[0], pong[1], count, false};
+	coro_sched_init();
+	uint64_t start = bench_now_ns();
+	coro_new_ex(bench_pipe_f, &a, 64 * 1024);
+	coro_new_ex(bench_pipe_f, &b, 64 * 1024);
+	struct coro *c;
+	int failed = 0;
+	while ((c = coro_sched_wait()) != NULL) {
+		failed += coro_status(c) != 0;
+		coro_delete(c);
+	}
+	uint64_t elapsed = bench_now_ns() - start;
+	printf("io: pipe, %ld round trips, %.0f ns per round trip%s\n", count,
+	       (double)elapsed / count, failed ? ", FAILED" : "");
+	close(ping[0]);
+	close(ping[1]);
+	close(pong[0]);
+	close(pong[1]);
+
+	int coro_count = 4;
+	long reads = 5000;
+	start = bench_now_ns();
+	for (int i = 0; i < coro_count; ++i)
+		coro_new_ex(bench_offload_f, &reads, 64 * 1024);
+	failed = 0;
+	while ((c = coro_sched_wait()) != NULL) {
+		failed += coro_status(c) != 0;
+		coro_delete(c);
+	}
+	elapsed = bench_now_ns() - start;
+	coro_sched_destroy();
+	printf("io: offload, %ld reads, %.0f ns per read%s\n",
+	       coro_count * reads, (double)elapsed / (coro_count * reads),
+	       failed ? ", FAILED" : "");
+}
+
+struct bench_chan_arg {
+	struct coro_chan *in;
+	struct coro_chan *out;
+	long count;
+	/** Sends first, the other side only answers. */
+	bool is_initiator;
+};
+
+static int
+bench_chan_f(void *arg)
+{
+	struct bench_chan_arg *a = arg;
+	void *msg = NULL;
+	for (long i = 0; i < a->count; ++i) {
+		if (a->is_initiator && coro_chan_send(a->out, msg) != 0)
+			return -1;
+		if (coro_chan_recv(a->in, &msg) != 0)
+			return -1;
+		if (! a->is_initiator && coro_chan_send(a->out, msg) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int
+bench_blocked_f(void *arg)
+{
+	void *msg;
+	/* Returns -1 once the channel is closed. */
+	return coro_chan_recv(arg, &msg) == -1 ? 0 : -1;
+}
+
+struct bench_counter {
+	struct coro_mutex *mutex;
+	struct coro_wg *wg;
+	long value;
+	long count;
+};
+
+static int
+bench_counter_f(void *arg)
+{
+	struct bench_counter *cnt = arg;
+	for (long i = 0; i < cnt->count; ++i) {
+		coro_mutex_lock(cnt->mutex);
+		long value = cnt->value;
+		/* Let others try to take the mutex meanwhile. */
+		if (i % 16 == 0)
+			coro_yield();
+		cnt->value = value + 1;
+		coro_mutex_unlock(cnt->mutex);
+	}
+	coro_wg_done(cnt->wg);
+	return 0;
+}
+
+static int
+bench_counter_wait_f(void *arg)
+{
+	struct bench_counter *cnt = arg;
+	coro_wg_wait(cnt->wg);
+	return cnt->value == 4 * cnt->count ? 0 : -1;
+}
+
+/** Run all the created coroutines, return how many failed. */
+static int
+bench_reap_all(void)
+{
+	int failed = 0;
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL) {
+		failed += coro_status(c) != 0;
+		coro_delete(c);
+	}
+	return failed;
+}
+
+/**
+ * Synchronization primitives. A message ping-pong over two
+ * unbuffered channels. Then yields of two coroutines while 10k
+ * others are blocked on a channel - they should not make the
+ * yields slower. Then a mutex-protected counter bumped by 4
+ * coroutines on 1 and on 4 threads, awaited via a wait group.
+ */
+static void
+bench_sync(void)
+{
+	long count = 1000000;
+	coro_sched_init();
+	struct coro_chan *ping = coro_chan_new(0);
+	struct coro_chan *pong = coro_chan_new(0);
+	struct bench_chan_arg a = {pong, ping, count, true};
+	struct bench_chan_arg b = {ping, pong, count, false};
+	uint64_t start = bench_now_ns();
+	coro_new_ex(bench_chan_f, &a, 64 * 1024);
+	coro_new_ex(bench_chan_f, &b, 64 * 1024);
+	int failed = bench_reap_all();
+	uint64_t elapsed = bench_now_ns() - start;
+	printf("sync: channel, %ld round trips, %.0f ns per round trip%s\n",
+	       count, (double)elapsed / count, failed ? ", FAILED" : "");
+	coro_chan_delete(ping);
+	coro_chan_delete(pong);
+
+	int blocked_count = 10000;
+	long yields = 5000000;
+	struct coro_chan *never = coro_chan_new(0);
+	for (int i = 0; i < blocked_count; ++i)
+		coro_new_ex(bench_blocked_f, never, 16 * 1024);
+	for (int i = 0; i < 2; ++i)
+		coro_new_ex(bench_yield_f, &yields, 64 * 1024);
+	start = bench_now_ns();
+	struct coro *c;
+	for (int i = 0; i < 2; ++i) {
+		c = coro_sched_wait();
+		coro_delete(c);
+	}
+	elapsed = bench_now_ns() - start;
+	coro_chan_close(never);
+	failed = bench_reap_all();
+	coro_chan_delete(never);
+	printf("sync: %d blocked coroutines, %.1f ns per coro_yield()%s\n",
+	       blocked_count, (double)elapsed / (2 * yields),
+	       failed ? ", FAILED" : "");
+
+	for (int threads = 0; threads <= 4; threads += 4) {
+		if (threads == 0)
+			coro_sched_init();
+		else
+			coro_sched_init_threads(threads);
+		struct bench_counter cnt;
+		cnt.mutex = coro_mutex_new();
+		cnt.wg = coro_wg_new();
+		cnt.value = 0;
+		cnt.count = 100000;
+		coro_wg_add(cnt.wg, 4);
+		start = bench_now_ns();
+		coro_new_ex(bench_counter_wait_f, &cnt, 64 * 1024);
+		for (int i = 0; i < 4; ++i)
+			coro_new_ex(bench_counter_f, &cnt, 64 * 1024);
+		failed = bench_reap_all();
+		elapsed = bench_now_ns() - start;
+		coro_sched_destroy();
+		printf("sync: mutex, %d worker threads, %ld locks, %.0f ns per "
+		       "lock%s\n", threads, 4 * cnt.count,
+		       (double)elapsed / (4 * cnt.count), failed ? ", FAILED" : "");
+		coro_mutex_delete(cnt.mutex);
+		coro_wg_delete(cnt.wg);
+	}
+}
+
+static int
+bench_quantum_f(void *arg)
+{
+	long count = *(long *)arg;
+	long expired = 0;
+	coro_set_quantum(coro_this(), 1000000);
+	uint64_t start = bench_now_ns();
+	for (long i = 0; i < count; ++i)
+		expired += coro_quantum_is_over();
+	uint64_t mid = bench_now_ns();
+	for (long i = 0; i < count; ++i)
+		expired += bench_now_ns() == 0;
+	uint64_t end = bench_now_ns();
+	printf("timer: %.1f ns per coro_quantum_is_over(), %.1f ns per "
+	       "clock_gettime()\n", (double)(mid - start) / count,
+	       (double)(end - mid) / count);
+	return expired != 0;
+}
+
+struct bench_sleep_arg {
+	uint64_t us;
+	/** Sum of how late the sleepers woke up. */
+	uint64_t *late_us;
+};
+
+static int
+bench_sleep_f(void *arg)
+{
+	struct bench_sleep_arg *a = arg;
+	uint64_t start = coro_time_us();
+	coro_sleep_us(a->us);
+	uint64_t slept = coro_time_us() - start;
+	if (slept < a->us)
+		return -1;
+	__atomic_add_fetch(a->late_us, slept - a->us, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/**
+ * Timers. Cost of the time slice check against a clock_gettime().
+ * Then 10k coroutines sleep from 0 to 100ms, which spreads them
+ * over 3 levels of the timer wheel, on 1 and on 4 threads. None
+ * should wake up early.
+ */
+static void
+bench_timer(void)
+{
+	long count = 10000000;
+	coro_sched_init();
+	coro_new(bench_quantum_f, &count);
+	int failed = bench_reap_all();
+	coro_sched_destroy();
+	if (failed)
+		printf("timer: quantum, FAILED\n");
+
+	int sleeper_count = 10000;
+	struct bench_sleep_arg *args = malloc(sleeper_count * sizeof(*args));
+	for (int threads = 0; threads <= 4; threads += 4) {
+		if (threads == 0)
+			coro_sched_init();
+		else
+			coro_sched_init_threads(threads);
+		uint64_t late_us = 0;
+		uint64_t start = bench_now_ns();
+		for (int i = 0; i < sleeper_count; ++i) {
+			args[i].us = (uint64_t)i * 7919 % 100000;
+			args[i].late_us = &late_us;
+			coro_new_ex(bench_sleep_f, &args[i], 16 * 1024);
+		}
+		failed = bench_reap_all();
+		uint64_t elapsed = bench_now_ns() - start;
+		coro_sched_destroy();
+		printf("timer: %d worker threads, %d sleepers, %.1f ms total, "
+		       "%.1f us late on average%s\n", threads, sleeper_count,
+		       elapsed / 1e6, (double)late_us / sleeper_count,
+		       failed ? ", FAILED" : "");
+	}
+	free(args);
+}
+
+struct bench_spin_arg {
+	uint64_t deadline_us;
+	/** CPU time the coroutine has got. */
+	uint64_t cpu_us;
+};
+
+static int
+bench_spin_f(void *arg)
+{
+	struct bench_spin_arg *a = arg;
+	coro_set_quantum(coro_this(), 100);
+	uint64_t start = coro_time_us();
+	uint64_t now = start;
+	while (now < a->deadline_us) {
+		if (coro_quantum_is_over()) {
+			a->cpu_us += now - start;
+			coro_yield();
+			start = coro_time_us();
+		}
+		now = coro_time_us();
+	}
+	a->cpu_us += now - start;
+	return 0;
+}
+
+/**
+ * Scheduling policies. Cost of a yield between two coroutines
+ * under each policy. Then 3 coroutines of priorities -5, 0, 5
+ * spin for 100ms with 100us quanta: round-robin shares the CPU
+ * equally, the priority policy gives it all to the first one,
+ * the fair share - about 3:1 between the neighbours.
+ */
+static void
+bench_policy(void)
+{
+	static const char *names[] = {"rr", "prio", "fair"};
+	enum coro_policy policies[] = {
+		CORO_POLICY_RR, CORO_POLICY_PRIO, CORO_POLICY_FAIR,
+	};
+	for (int i = 0; i < 3; ++i) {
+		long count = 2000000;
+		coro_sched_init();
+		coro_sched_set_policy(policies[i]);
+		for (int j = 0; j < 2; ++j)
+			coro_new(bench_yield_f, &count);
+		uint64_t start = bench_now_ns();
+		int failed = bench_reap_all();
+		uint64_t elapsed = bench_now_ns() - start;
+
+		int prios[] = {-5, 0, 5};
+		struct bench_spin_arg args[3];
+		uint64_t deadline = coro_time_us() + 100000;
+		for (int j = 0; j < 3; ++j) {
+			args[j].deadline_us = deadline;
+			args[j].cpu_us = 0;
+			coro_set_priority(coro_new(bench_spin_f, &args[j]),
+					  prios[j]);
+		}
+		failed += bench_reap_all();
+		coro_sched_destroy();
+		uint64_t total = args[0].cpu_us + args[1].cpu_us +
+				 args[2].cpu_us;
+		printf("policy: %s, %.1f ns per coro_yield(), CPU shares of "
+		       "priorities -5/0/5: %.0f%%/%.0f%%/%.0f%%%s\n", names[i],
+		       (double)elapsed / (2 * count),
+		       100.0 * args[0].cpu_us / total,
+		       100.0 * args[1].cpu_us / total,
+		       100.0 * args[2].cpu_us / total, failed ? ", FAILED" : "");
+	}
+}
+
+struct bench_latency_arg {
+	uint64_t work_us;
+	bool is_adaptive;
+	struct coro_stats stats;
+};
+
+enum {
+	BENCH_LATENCY_COROS = 8,
+	BENCH_LATENCY_TARGET_US = 1000,
+	/** Work between two checks of the quantum, like a sort block. */
+	BENCH_LATENCY_BLOCK_US = 20,
+};
+
+static int
+bench_latency_f(void *arg)
+{
+	struct bench_latency_arg *a = arg;
+	struct coro *this = coro_this();
+	coro_set_quantum(this, BENCH_LATENCY_TARGET_US /
+			 BENCH_LATENCY_COROS);
+	coro_set_latency_target(this, BENCH_LATENCY_TARGET_US,
+				a->is_adaptive);
+	uint64_t done = 0;
+	while (done < a->work_us) {
+		uint64_t start = coro_time_us();
+		while (coro_time_us() < start + BENCH_LATENCY_BLOCK_US) {
+		}
+		done += BENCH_LATENCY_BLOCK_US;
+		if (coro_quantum_is_over())
+			coro_yield();
+	}
+	coro_stats(this, &a->stats);
+	return 0;
+}
+
+/**
+ * Fixed and adaptive quanta. 8 coroutines with 5..40ms of work
+ * in 20us blocks share a 1ms latency. The fixed quantum is the
+ * latency divided by all of them: it stays short, when the short
+ * ones are done, and the slices overshoot it by a block. The
+ * adaptive one is the latency shared by the ones in the queue,
+ * shortened only after misses - fewer switches, and the overshoots
+ * are taken into account. The latency target gives the statistics
+ * without coro_stats_enable().
+ */
+static void
+bench_latency(void)
+{
+	for (int is_adaptive = 0; is_adaptive <= 1; ++is_adaptive) {
+		struct bench_latency_arg args[BENCH_LATENCY_COROS];
+		coro_sched_init();
+		for (int i = 0; i < BENCH_LATENCY_COROS; ++i) {
+			args[i].work_us = (i + 1) * 5000;
+			args[i].is_adaptive = is_adaptive;
+			coro_new(bench_latency_f, &args[i]);
+		}
+		uint64_t start = bench_now_ns();
+		int failed = bench_reap_all();
+		uint64_t elapsed = bench_now_ns() - start;
+		coro_sched_destroy();
+
+		long long runs = 0, misses = 0;
+		uint64_t max_latency = 0;
+		for (int i = 0; i < BENCH_LATENCY_COROS; ++i) {
+			runs += args[i].stats.run_count;
+			misses += args[i].stats.latency_miss_count;
+			if (args[i].stats.max_latency_us > max_latency)
+				max_latency = args[i].stats.max_latency_us;
+		}
+		printf("latency: %s, %.1f ms, %lld runs, %lld over %d us, "
+		       "max wait %llu us%s\n",
+		       is_adaptive ? "adaptive" : "fixed", elapsed / 1e6, runs,
+		       misses, BENCH_LATENCY_TARGET_US,
+		       (unsigned long long)max_latency,
+		       failed ? ", FAILED" : "");
+	}
+}
+
+/**
+ * Profiling overhead. Yields between two coroutines with the
+ * statistics off and on, then the latency histogram of the run.
+ */
+static void
+bench_stats(void)
+{
+	long count = 2000000;
+	for (int is_enabled = 0; is_enabled <= 1; ++is_enabled) {
+		coro_sched_init();
+		coro_stats_enable(is_enabled);
+		for (int j = 0; j < 2; ++j)
+			coro_new(bench_yield_f, &count);
+		uint64_t start = bench_now_ns();
+		int failed = bench_reap_all();
+		uint64_t elapsed = bench_now_ns() - start;
+		coro_sched_destroy();
+		printf("stats: %s, %.1f ns per coro_yield()%s\n",
+		       is_enabled ? "on" : "off", (double)elapsed / (2 * count),
+		       failed ? ", FAILED" : "");
+	}
+	coro_stats_enable(false);
+	uint64_t hist[CORO_LATENCY_BUCKETS];
+	coro_latency_histogram(hist);
+	printf("stats: run queue waits below 1us %llu, 1-2us %llu, "
+	       "longer %llu\n", (unsigned long long)hist[0],
+	       (unsigned long long)hist[1], (unsigned long long)(2 * count -
+	       hist[0] - hist[1]));
+}
+
+/** Resident memory of the process in bytes. */
+static size_t
+bench_rss(void)
+{
+	long size = 0, pages = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f != NULL) {
+		if (fscanf(f, "%ld %ld", &size, &pages) != 2)
+			pages = 0;
+		fclose(f);
+	}
+	return pages * sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * Park @a count coroutines on a channel, created by @a new_f, and
+ * report the memory they take. Then wake and reap them all.
+ */
+static void
+bench_fanout(const char *name, struct coro *(*new_f)(coro_f, void *),
+	     long count)
+{
+	coro_sched_init();
+	struct coro_chan *never = coro_chan_new(0);
+	size_t rss = bench_rss();
+	uint64_t start = bench_now_ns();
+	for (long i = 0; i < count; ++i)
+		new_f(bench_blocked_f, never);
+	/* Let all of them run up to the parking. */
+	struct coro *c = coro_sched_wait();
+	uint64_t elapsed = bench_now_ns() - start;
+	size_t used = bench_rss() - rss;
+	coro_chan_close(never);
+	int failed = c != NULL;
+	failed += bench_reap_all();
+	coro_chan_delete(never);
+	coro_sched_destroy();
+	printf("small: %ld %s coroutines parked, %.0f MB, %.0f bytes each, "
+	       "%.0f ns to create and park each%s\n", count, name,
+	       used / 1e6, (double)used / count, (double)elapsed / count,
+	       failed ? ", FAILED" : "");
+}
+
+static struct coro *
+bench_new_16k(coro_f func, void *arg)
+{
+	return coro_new_ex(func, arg, 16 * 1024);
+}
+
+/**
+ * Small coroutines on shared stacks against the ones with own
+ * stacks. Yields between two coroutines of each kind, then memory
+ * of parked ones: 1M small ones, and 20k regular ones with 16KB
+ * stacks - more would hit the limit of mappings of the process.
+ */
+static void
+bench_small(void)
+{
+	long count = 2000000;
+	for (int is_small = 0; is_small <= 1; ++is_small) {
+		coro_sched_init();
+		for (int j = 0; j < 2; ++j) {
+			if (is_small)
+				coro_new_small(bench_yield_f, &count);
+			else
+				coro_new(bench_yield_f, &count);
+		}
+		uint64_t start = bench_now_ns();
+		int failed = bench_reap_all();
+		uint64_t elapsed = bench_now_ns() - start;
+		coro_sched_destroy();
+		printf("small: %s, %.1f ns per coro_yield()%s\n",
+		       is_small ? "shared stack" : "own stack",
+		       (double)elapsed / (2 * count), failed ? ", FAILED" : "");
+	}
+	bench_fanout("regular", bench_new_16k, 20000);
+	/* Without the asm backend they have own stacks too. */
+	bool is_shared = strcmp(coro_switch_backend(), "sigjmp") != 0;
+	bench_fanout("small", coro_new_small, is_shared ? 1000000 : 20000);
+}
+
+static int
+bench_child_f(void *arg)
+{
+	coro_set_result(arg);
+	return 0;
+}
+
+static int
+bench_join_f(void *arg)
+{
+	long count = *(long *)arg;
+	for (long i = 0; i < count; ++i) {
+		struct coro *c = coro_new_small(bench_child_f, arg);
+		void *result;
+		if (coro_join(c, &result) != 0 || result != arg)
+			return -1;
+		coro_delete(c);
+	}
+	return 0;
+}
+
+static int
+bench_local_f(void *arg)
+{
+	long count = *(long *)arg;
+	int key = coro_local_key_new();
+	coro_local_set(key, arg);
+	long sum = 0;
+	for (long i = 0; i < count; ++i)
+		sum += *(long *)coro_local_get(key);
+	return sum == count * count ? 0 : -1;
+}
+
+/**
+ * A coroutine spawns small children one by one and joins each,
+ * getting its result - a full spawn, run, join and delete cycle.
+ * Then reads of a coroutine-local slot.
+ */
+static void
+bench_join(void)
+{
+	long count = 1000000;
+	coro_sched_init();
+	uint64_t start = bench_now_ns();
+	coro_new(bench_join_f, &count);
+	int failed = bench_reap_all();
+	uint64_t elapsed = bench_now_ns() - start;
+	printf("join: %ld children, %.0f ns per spawn and join%s\n", count,
+	       (double)elapsed / count, failed ? ", FAILED" : "");
+
+	count = 100000000;
+	coro_new(bench_local_f, &count);
+	start = bench_now_ns();
+	failed = bench_reap_all();
+	elapsed = bench_now_ns() - start;
+	coro_sched_destroy();
+	printf("join: %.2f ns per coro_local_get()%s\n",
+	       (double)elapsed / count, failed ? ", FAILED" : "");
+}
+
+struct bench_case {
+	const char *name;
+	void (*run)(void);
+};
+
+static const struct bench_case bench_cases[] = {
+	{"yield", bench_yield},
+	{"create", bench_create},
+	{"reap", bench_reap},
+	{"threads", bench_threads},
+	{"io", bench_io},
+	{"sync", bench_sync},
+	{"timer", bench_timer},
+	{"policy", bench_policy},
+	{"stats", bench_stats},
+	{"latency", bench_latency},
+	{"small", bench_small},
+	{"join", bench_join},
+};
+
+int
+main(int argc, char **argv)
+{
+	int case_count = sizeof(bench_cases) / sizeof(bench_cases[0]);
+	for (int i = 0; i < case_count; ++i) {
+		bool is_selected = argc < 2;
+		for (int j = 1; j < argc && ! is_selected; ++j)
+			is_selected = strcmp(argv[j], bench_cases[i].name) == 0;
+		if (is_selected)
+			bench_cases[i].run();
+	}
+	return 0;
+}
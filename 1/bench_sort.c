@@ -0,0 +1,490 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include "libcoro.h"
+#include "sort_algo.h"
+#include "sort_ext.h"
+#include "sort_io.h"
+#include "sort_merge.h"
+
+// Benchmarks of the sorter's building blocks. Run without arguments to execute
+// all of them, or pass names of the ones to run. Files are created in /tmp
+
+#define BENCH_COUNT (4 * 1000 * 1000)
+
+static uint64_t bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Random numbers of the full int range, like generator.py makes
+static int *bench_numbers(int count) {
+    int *arr = (int *) malloc(sizeof(int) * count);
+    srand(42);
+    for (int i = 0; i < count; i++) {
+        arr[i] = (int) (((unsigned) rand() << 16) ^ (unsigned) rand());
+    }
+    return arr;
+}
+
+// Loading of a file and storing it back sorted, in the text and the binary
+// formats. The file is in the page cache, as right after the generator
+static void bench_load(void) {
+    int *arr = bench_numbers(BENCH_COUNT);
+
+    for (int is_binary = 0; is_binary <= 1; is_binary++) {
+        const char *name = is_binary ? "/tmp/bench_sort.bin" : "/tmp/bench_sort.txt";
+        write_to_file(name, arr, BENCH_COUNT, is_binary);
+
+        struct File file = {.name = name};
+        uint64_t start = bench_now_ns();
+        file_load(&file);
+        uint64_t loaded = bench_now_ns();
+        file_store(&file);
+        uint64_t stored = bench_now_ns();
+
+        int failed = file.size != BENCH_COUNT || memcmp(file.arr, arr, sizeof(int) * BENCH_COUNT) != 0;
+        file_release(&file);
+        unlink(name);
+
+        printf("load: %s, %d numbers, load %.1f ms (%.1f ns per number), store %.1f ms%s\n",
+               is_binary ? "binary" : "text", BENCH_COUNT, (loaded - start) / 1e6,
+               (double) (loaded - start) / BENCH_COUNT, (stored - loaded) / 1e6,
+               failed ? ", FAILED" : "");
+    }
+    free(arr);
+}
+
+// The loader sort_io had before - the whole file read into a null-terminated
+// text, parsed by strtol() twice: to count the numbers and to store them
+static int *bench_parse_strtol(const char *name, int *count) {
+    FILE *f = fopen(name, "r");
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *text = (char *) malloc(size + 1);
+    text[fread(text, 1, size, f)] = '\0';
+    fclose(f);
+
+    int *arr = NULL;
+    for (int pass = 0; pass < 2; pass++) {
+        const char *pos = text;
+        char *end;
+        int len = 0;
+        while (1) {
+            long value = strtol(pos, &end, 10);
+            if (end == pos) break;
+            if (arr != NULL) arr[len] = (int) value;
+            len++;
+            pos = end;
+        }
+        if (arr == NULL) arr = (int *) malloc(sizeof(int) * (len > 0 ? len : 1));
+        *count = len;
+    }
+    free(text);
+    return arr;
+}
+
+static int bench_parse_f(void *arg) {
+    file_load((struct File *) arg);
+    return 0;
+}
+
+// Parsing throughput over a text file like generator.py makes: numbers up to
+// 2^31, separated by spaces, in the page cache. The old strtol() loader
+// against file_load(), which the sorter runs - outside of coroutines, and in
+// one, where the next buffer is read while the current one is parsed
+static void bench_parse(void) {
+    int *arr = bench_numbers(BENCH_COUNT);
+    const char *name = "/tmp/bench_sort.txt";
+    FILE *f = fopen(name, "w");
+    long size = 0;
+    for (int i = 0; i < BENCH_COUNT; i++) {
+        arr[i] = (int) ((unsigned) arr[i] >> 1);
+        size += fprintf(f, i + 1 < BENCH_COUNT ? "%d " : "%d", arr[i]);
+    }
+    fclose(f);
+
+    static const char *rounds[] = {"strtol", "file_load", "file_load in a coroutine"};
+    for (int round = 0; round < 3; round++) {
+        struct File file = {.name = name};
+        int count = 0;
+        int *got = NULL;
+        uint64_t start = bench_now_ns();
+        if (round == 0) {
+            got = bench_parse_strtol(name, &count);
+        } else if (round == 1) {
+            file_load(&file);
+        } else {
+            coro_sched_init();
+            struct coro *c = coro_new(bench_parse_f, &file);
+            coro_join(c, NULL);
+            coro_delete(c);
+            coro_sched_destroy();
+        }
+        uint64_t elapsed = bench_now_ns() - start;
+        if (round > 0) {
+            got = file.arr;
+            count = file.size;
+        }
+
+        int failed = count != BENCH_COUNT || memcmp(got, arr, sizeof(int) * BENCH_COUNT) != 0;
+        if (round > 0) {
+            file_release(&file);
+        } else {
+            free(got);
+        }
+        printf("parse: %s, %.1f MB, %.0f MB/s, %.1f ns per number%s\n",
+               rounds[round], size / 1e6, size * 1e3 / elapsed,
+               (double) elapsed / BENCH_COUNT, failed ? ", FAILED" : "");
+    }
+    unlink(name);
+    free(arr);
+}
+
+// The writer sort_io had before - sprintf("%d ") into a 64KB buffer
+static void bench_write_sprintf(const char *name, const int *arr, int count) {
+    FILE *f = fopen(name, "w");
+    char *buf = (char *) malloc(64 * 1024);
+    size_t len = 0;
+    for (int i = 0; i < count; i++) {
+        if (64 * 1024 - len < 16) {
+            fwrite(buf, 1, len, f);
+            len = 0;
+        }
+        len += sprintf(buf + len, "%d ", arr[i]);
+    }
+    fwrite(buf, 1, len, f);
+    free(buf);
+    fclose(f);
+}
+
+static int bench_write_f(void *arg) {
+    int *arr = (int *) arg;
+    write_to_file("/tmp/bench_sort.txt", arr, BENCH_COUNT, false);
+    return 0;
+}
+
+// Text output of 4M numbers: the old sprintf() writer, the new one outside
+// of coroutines - the buffers are written right away - and inside one, where
+// a writer coroutine writes a buffer while the next one is formatted
+static void bench_write(void) {
+    int *arr = bench_numbers(BENCH_COUNT);
+    const char *name = "/tmp/bench_sort.txt";
+
+    for (int round = 0; round < 3; round++) {
+        uint64_t start = bench_now_ns();
+        if (round == 0) {
+            bench_write_sprintf(name, arr, BENCH_COUNT);
+        } else if (round == 1) {
+            write_to_file(name, arr, BENCH_COUNT, false);
+        } else {
+            coro_sched_init();
+            struct coro *c = coro_new(bench_write_f, arr);
+            coro_join(c, NULL);
+            coro_delete(c);
+            coro_sched_destroy();
+        }
+        uint64_t elapsed = bench_now_ns() - start;
+
+        struct File file = {.name = name};
+        file_load(&file);
+        int failed = file.size != BENCH_COUNT || memcmp(file.arr, arr, sizeof(int) * BENCH_COUNT) != 0;
+        file_release(&file);
+        unlink(name);
+
+        const char *names[] = {"sprintf", "int_writer", "int_writer in a coroutine"};
+        printf("write: %s, %.1f ms, %.1f ns per number%s\n", names[round], elapsed / 1e6,
+               (double) elapsed / BENCH_COUNT, failed ? ", FAILED" : "");
+    }
+    free(arr);
+}
+
+static int bench_int_cmp(const void *a, const void *b) {
+    int x = *(const int *) a, y = *(const int *) b;
+    return (x > y) - (x < y);
+}
+
+// The merge solution.c had before - a scan of all the heads per number, with
+// INT32_MAX as "no head"
+static void bench_merge_scan(const int *const *arrays, const int *sizes, int k, int *out, int total) {
+    int *current_pos = (int *) calloc(k, sizeof(int));
+    for (int i = 0; i < total; i++) {
+        int min = INT32_MAX, pos = -1;
+        for (int j = 0; j < k; j++) {
+            if (current_pos[j] >= sizes[j]) continue;
+            if (arrays[j][current_pos[j]] < min) {
+                pos = j;
+                min = arrays[j][current_pos[j]];
+            }
+        }
+        if (pos < 0) break;
+        current_pos[pos]++;
+        out[i] = min;
+    }
+    free(current_pos);
+}
+
+// K-way merge of 4M numbers split into k sorted arrays, k from 2 to 4096. The
+// linear scan is measured up to k = 256, it is O(n * k)
+static void bench_merge(void) {
+    int *arr = bench_numbers(BENCH_COUNT);
+    int *out = (int *) malloc(sizeof(int) * BENCH_COUNT);
+    int *expect = (int *) malloc(sizeof(int) * BENCH_COUNT);
+    memcpy(expect, arr, sizeof(int) * BENCH_COUNT);
+    qsort(expect, BENCH_COUNT, sizeof(int), bench_int_cmp);
+
+    for (int k = 2; k <= 4096; k *= 2) {
+        const int **arrays = (const int **) malloc(sizeof(int *) * k);
+        int *sizes = (int *) malloc(sizeof(int) * k);
+        for (int i = 0; i < k; i++) {
+            int begin = (int) ((long) BENCH_COUNT * i / k);
+            sizes[i] = (int) ((long) BENCH_COUNT * (i + 1) / k) - begin;
+            arrays[i] = arr + begin;
+            qsort(arr + begin, sizes[i], sizeof(int), bench_int_cmp);
+        }
+
+        uint64_t start = bench_now_ns();
+        struct merge_tree *tree = merge_tree_new(arrays, sizes, k);
+        int len = 0, rc;
+        while ((rc = merge_tree_next(tree, out + len, 4096)) > 0) len += rc;
+        merge_tree_delete(tree);
+        uint64_t tree_ns = bench_now_ns() - start;
+        int failed = len != BENCH_COUNT || memcmp(out, expect, sizeof(int) * BENCH_COUNT) != 0;
+
+        printf("merge: k %4d, loser tree %.1f ns per number", k, (double) tree_ns / BENCH_COUNT);
+        if (k <= 256) {
+            start = bench_now_ns();
+            bench_merge_scan(arrays, sizes, k, out, BENCH_COUNT);
+            uint64_t scan_ns = bench_now_ns() - start;
+            printf(", linear scan %.1f ns per number", (double) scan_ns / BENCH_COUNT);
+        }
+        printf("%s\n", failed ? ", FAILED" : "");
+        free(arrays);
+        free(sizes);
+    }
+    free(arr);
+    free(out);
+    free(expect);
+}
+
+// The sort solution.c had before - Hoare partitioning around the middle number,
+// recursing into both sides
+static void bench_quick_sort(int *arr, int low, int high) {
+    int pivot = arr[low + (high - low) / 2];
+    int i = low, j = high;
+    while (i <= j) {
+        while (arr[i] < pivot) i++;
+        while (arr[j] > pivot) j--;
+        if (i <= j) {
+            int tmp = arr[i];
+            arr[i++] = arr[j];
+            arr[j--] = tmp;
+        }
+    }
+    if (low < j) bench_quick_sort(arr, low, j);
+    if (i < high) bench_quick_sort(arr, i, high);
+}
+
+static void bench_sort_quick(int *arr, int size) {
+    bench_quick_sort(arr, 0, size - 1);
+}
+
+static void bench_sort_qsort(int *arr, int size) {
+    qsort(arr, size, sizeof(int), bench_int_cmp);
+}
+
+// Sorts of 4M numbers of different patterns: the old quick sort, qsort(),
+// pdq_sort(), radix_sort() and simd_sort(). The old sort is not run on the organ pipe - the
+// middle pivot is the largest number in every range there, it is O(n^2)
+static void bench_sort(void) {
+    const char *patterns[] = {"random", "sorted", "reversed", "16 values", "organ pipe", "equal"};
+    const char *sort_names[] = {"quick_sort", "qsort", "pdq_sort", "radix_sort", "simd_sort"};
+    void (*sorts[])(int *, int) = {bench_sort_quick, bench_sort_qsort, pdq_sort, radix_sort, simd_sort};
+    int *input = bench_numbers(BENCH_COUNT);
+    int *arr = (int *) malloc(sizeof(int) * BENCH_COUNT);
+    int *expect = (int *) malloc(sizeof(int) * BENCH_COUNT);
+
+    for (int p = 0; p < 6; p++) {
+        for (int i = 0; i < BENCH_COUNT; i++) {
+            int v = input[i];
+            if (p == 1) v = i - BENCH_COUNT / 2;
+            if (p == 2) v = BENCH_COUNT / 2 - i;
+            if (p == 3) v = input[i] % 16;
+            if (p == 4) v = i < BENCH_COUNT / 2 ? i : BENCH_COUNT - i;
+            if (p == 5) v = 42;
+            arr[i] = v;
+        }
+        memcpy(expect, arr, sizeof(int) * BENCH_COUNT);
+        qsort(expect, BENCH_COUNT, sizeof(int), bench_int_cmp);
+
+        printf("sort: %-10s", patterns[p]);
+        for (int s = 0; s < 5; s++) {
+            if (s == 0 && p == 4) {
+                printf(", %s O(n^2)", sort_names[s]);
+                continue;
+            }
+            int *copy = (int *) malloc(sizeof(int) * BENCH_COUNT);
+            memcpy(copy, arr, sizeof(int) * BENCH_COUNT);
+            uint64_t start = bench_now_ns();
+            sorts[s](copy, BENCH_COUNT);
+            uint64_t elapsed = bench_now_ns() - start;
+            int failed = memcmp(copy, expect, sizeof(int) * BENCH_COUNT) != 0;
+            free(copy);
+            printf(", %s %.1f ms%s", sort_names[s], elapsed / 1e6, failed ? " FAILED" : "");
+            fflush(stdout);
+        }
+        printf("\n");
+    }
+    free(input);
+    free(arr);
+    free(expect);
+}
+
+// Random numbers sorted by the old quick sort, pdq_sort() and simd_sort(), from
+// 1M to 100M of them
+static void bench_simd(void) {
+    const char *sort_names[] = {"quick_sort", "pdq_sort", "simd_sort"};
+    void (*sorts[])(int *, int) = {bench_sort_quick, pdq_sort, simd_sort};
+
+    for (int count = 1000 * 1000; count <= 100 * 1000 * 1000; count *= 10) {
+        int *arr = bench_numbers(count);
+        int *copy = (int *) malloc(sizeof(int) * count);
+        int *expect = NULL;
+
+        printf("simd: %3dM numbers", count / 1000000);
+        for (int s = 0; s < 3; s++) {
+            memcpy(copy, arr, sizeof(int) * count);
+            uint64_t start = bench_now_ns();
+            sorts[s](copy, count);
+            uint64_t elapsed = bench_now_ns() - start;
+
+            int failed = 0;
+            if (expect == NULL) {
+                expect = copy;
+                copy = (int *) malloc(sizeof(int) * count);
+            } else {
+                failed = memcmp(copy, expect, sizeof(int) * count) != 0;
+            }
+            printf(", %s %.1f ms (%.1f ns per number)%s", sort_names[s], elapsed / 1e6,
+                   (double) elapsed / count, failed ? " FAILED" : "");
+            fflush(stdout);
+        }
+        printf("\n");
+        free(arr);
+        free(copy);
+        free(expect);
+    }
+}
+
+// External sort of a text file of 4M numbers within 4MB to 64MB, against
+// loading, sorting and storing it in memory
+static void bench_external(void) {
+    const char *name = "/tmp/bench_sort.txt";
+    int *arr = bench_numbers(BENCH_COUNT);
+    int *expect = (int *) malloc(sizeof(int) * BENCH_COUNT);
+    memcpy(expect, arr, sizeof(int) * BENCH_COUNT);
+    qsort(expect, BENCH_COUNT, sizeof(int), bench_int_cmp);
+
+    for (int memory_mb = 0; memory_mb <= 64; memory_mb = memory_mb > 0 ? memory_mb * 4 : 4) {
+        write_to_file(name, arr, BENCH_COUNT, false);
+        struct File file = {.name = name};
+        uint64_t start = bench_now_ns();
+        if (memory_mb > 0) {
+            ext_sort_file(name, (size_t) memory_mb * 1024 * 1024, simd_sort);
+        } else {
+            file_load(&file);
+            simd_sort(file.arr, file.size);
+            file_store(&file);
+            file_release(&file);
+        }
+        uint64_t elapsed = bench_now_ns() - start;
+
+        file_load(&file);
+        int failed = file.size != BENCH_COUNT || memcmp(file.arr, expect, sizeof(int) * BENCH_COUNT) != 0;
+        file_release(&file);
+        unlink(name);
+
+        if (memory_mb > 0) {
+            printf("external: %2d MB, %.1f ms%s\n", memory_mb, elapsed / 1e6, failed ? ", FAILED" : "");
+        } else {
+            printf("external: in memory, %.1f ms%s\n", elapsed / 1e6, failed ? ", FAILED" : "");
+        }
+    }
+    free(arr);
+    free(expect);
+}
+
+// Merge of 4M numbers from 64 arrays into a text file, split into 1, 2 and 4
+// parts, each one on its own thread. The speedup is bounded by the CPUs there
+// are, the parts also pay for a pass, which finds their sizes in the file
+static void bench_parallel(void) {
+    const int k = 64;
+    const char *name = "/tmp/bench_sort.txt";
+    int *arr = bench_numbers(BENCH_COUNT);
+    int *expect = (int *) malloc(sizeof(int) * BENCH_COUNT);
+    const int **arrays = (const int **) malloc(sizeof(int *) * k);
+    int *sizes = (int *) malloc(sizeof(int) * k);
+    memcpy(expect, arr, sizeof(int) * BENCH_COUNT);
+    qsort(expect, BENCH_COUNT, sizeof(int), bench_int_cmp);
+    for (int i = 0; i < k; i++) {
+        int begin = (int) ((long) BENCH_COUNT * i / k);
+        sizes[i] = (int) ((long) BENCH_COUNT * (i + 1) / k) - begin;
+        arrays[i] = arr + begin;
+        qsort(arr + begin, sizes[i], sizeof(int), bench_int_cmp);
+    }
+
+    for (int parts = 1; parts <= 4; parts *= 2) {
+        coro_sched_init_threads(parts);
+        uint64_t start = bench_now_ns();
+        merge_to_file(arrays, sizes, k, name, false, parts);
+        uint64_t elapsed = bench_now_ns() - start;
+        coro_sched_destroy();
+
+        struct File file = {.name = name};
+        file_load(&file);
+        int failed = file.size != BENCH_COUNT || memcmp(file.arr, expect, sizeof(int) * BENCH_COUNT) != 0;
+        file_release(&file);
+        unlink(name);
+
+        printf("parallel: %d parts, %.1f ms, %.1f ns per number, %ld CPUs%s\n", parts,
+               elapsed / 1e6, (double) elapsed / BENCH_COUNT, sysconf(_SC_NPROCESSORS_ONLN),
+               failed ? ", FAILED" : "");
+    }
+    free(arrays);
+    free(sizes);
+    free(expect);
+    free(arr);
+}
+
+struct bench_case {
+    const char *name;
+    void (*run)(void);
+};
+
+static const struct bench_case bench_cases[] = {
+    {"load", bench_load},
+    {"parse", bench_parse},
+    {"write", bench_write},
+    {"sort", bench_sort},
+    {"simd", bench_simd},
+    {"merge", bench_merge},
+    {"parallel", bench_parallel},
+    {"external", bench_external},
+};
+
+int main(int argc, char **argv) {
+    int case_count = sizeof(bench_cases) / sizeof(bench_cases[0]);
+    for (int i = 0; i < case_count; i++) {
+        bool is_selected = argc < 2;
+        for (int j = 1; j < argc && !is_selected; j++) {
+            is_selected = strcmp(argv[j], bench_cases[i].name) == 0;
+        }
+        if (is_selected) bench_cases[i].run();
+    }
+    return 0;
+}
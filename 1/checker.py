@@ -1,5 +1,6 @@
 import random
 import argparse
+from array import array
 
 maxint = 1 << 31
 
@@ -10,11 +11,17 @@ parser.add_argument('-f', type=str, required=True, help="file name")
 args = parser.parse_args()
 
 
-f = open(args.f, 'r')
+f = open(args.f, 'rb')
 data = f.read()
 f.close()
 
-data = data.split()
+# Binary files are magic BI32 and native int32 numbers
+if data[:4] == b'BI32':
+	numbers = array('i')
+	numbers.frombytes(data[4:])
+	data = numbers
+else:
+	data = data.split()
 prev_number = -(1 << 31 - 1)
 for i in range(0, len(data)):
 	try:
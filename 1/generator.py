@@ -1,5 +1,6 @@
 import random
 import argparse
+from array import array
 
 maxint = 1 << 31
 
@@ -7,9 +8,19 @@ parser = argparse.ArgumentParser(description = "Generate random numbers file")
 parser.add_argument('-f', type=str, required=True, help="file name")
 parser.add_argument('-c', type=int, required=True, help='number count')
 parser.add_argument('-m', type=int, default=maxint, help='maximal number')
+parser.add_argument('-b', action='store_true', help='binary format: magic '\
+		    'BI32 and native int32 numbers')
 args = parser.parse_args()
 random.seed()
 
+if args.b:
+	# Binary numbers are int32, so is the maximal one
+	m = min(args.m, maxint - 1)
+	numbers = array('i', (random.randint(0, m) for i in range(0, args.c)))
+	with open(args.f, 'wb') as f:
+		f.write(b'BI32')
+		numbers.tofile(f)
+	exit(0)
 
 f = open(args.f, 'w')
 
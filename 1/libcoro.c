@@ -5,151 +5,2710 @@
 #include <signal.h>
 #include <errno.h>
 #include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
 #include "libcoro.h"
 
 #define handle_error() ({printf("Error %s\n", strerror(errno)); exit(-1);})
 
+/*
+ * Context switch backend. On x86-64 and AArch64 the switch is a
+ * hand-written routine which saves and restores callee-saved
+ * registers only, and new coroutines get their initial frame
+ * written directly onto the stack. Everywhere else, or when
+ * LIBCORO_SWITCH_SIGJMP is defined, sigsetjmp/siglongjmp are used
+ * and new stacks are entered through a signal handler.
+ */
+#if !defined(LIBCORO_SWITCH_SIGJMP) && \
+    (defined(__x86_64__) || defined(__aarch64__))
+#define CORO_SWITCH_ASM 1
+#else
+#define CORO_SWITCH_ASM 0
+#endif
+
+#if CORO_SWITCH_ASM
+
+struct coro;
+
+/**
+ * Save callee-saved registers on the current stack, store the
+ * stack pointer into @a from_sp, load @a to_sp and restore the
+ * registers saved there.
+ */
+void
+coro_ctx_switch(void **from_sp, void *to_sp)
+	__attribute__((visibility("hidden")));
+
+/**
+ * The first code a new coroutine executes. coro_ctx_init() puts
+ * its address as the return address of the initial frame, so the
+ * first coro_ctx_switch() to the coroutine "returns" here. It
+ * calls the entry function with the argument, both taken from
+ * callee-saved registers of that frame.
+ */
+void
+coro_ctx_start(void)
+	__attribute__((visibility("hidden")));
+
+#if defined(__x86_64__)
+
+__asm__(
+	".text\n"
+	".globl coro_ctx_switch\n"
+	".hidden coro_ctx_switch\n"
+	".type coro_ctx_switch, @function\n"
+	"coro_ctx_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size coro_ctx_switch, .-coro_ctx_switch\n"
+
+	".globl coro_ctx_start\n"
+	".hidden coro_ctx_start\n"
+	".type coro_ctx_start, @function\n"
+	"coro_ctx_start:\n"
+	"	movq %rbx, %rdi\n"
+	"	callq *%r12\n"
+	"	ud2\n"
+	".size coro_ctx_start, .-coro_ctx_start\n"
+);
+
+#else /* __aarch64__ */
+
+__asm__(
+	".text\n"
+	".globl coro_ctx_switch\n"
+	".hidden coro_ctx_switch\n"
+	".type coro_ctx_switch, %function\n"
+	"coro_ctx_switch:\n"
+	"	sub sp, sp, #160\n"
+	"	stp x19, x20, [sp, #0]\n"
+	"	stp x21, x22, [sp, #16]\n"
+	"	stp x23, x24, [sp, #32]\n"
+	"	stp x25, x26, [sp, #48]\n"
+	"	stp x27, x28, [sp, #64]\n"
+	"	stp x29, x30, [sp, #80]\n"
+	"	stp d8, d9, [sp, #96]\n"
+	"	stp d10, d11, [sp, #112]\n"
+	"	stp d12, d13, [sp, #128]\n"
+	"	stp d14, d15, [sp, #144]\n"
+	"	mov x9, sp\n"
+	"	str x9, [x0]\n"
+	"	mov sp, x1\n"
+	"	ldp x19, x20, [sp, #0]\n"
+	"	ldp x21, x22, [sp, #16]\n"
+	"	ldp x23, x24, [sp, #32]\n"
+	"	ldp x25, x26, [sp, #48]\n"
+	"	ldp x27, x28, [sp, #64]\n"
+	"	ldp x29, x30, [sp, #80]\n"
+	"	ldp d8, d9, [sp, #96]\n"
+	"	ldp d10, d11, [sp, #112]\n"
+	"	ldp d12, d13, [sp, #128]\n"
+	"	ldp d14, d15, [sp, #144]\n"
+	"	add sp, sp, #160\n"
+	"	ret\n"
+	".size coro_ctx_switch, .-coro_ctx_switch\n"
+
+	".globl coro_ctx_start\n"
+	".hidden coro_ctx_start\n"
+	".type coro_ctx_start, %function\n"
+	"coro_ctx_start:\n"
+	"	mov x0, x19\n"
+	"	blr x20\n"
+	"	brk #0\n"
+	".size coro_ctx_start, .-coro_ctx_start\n"
+);
+
+#endif /* __aarch64__ */
+
+#endif /* CORO_SWITCH_ASM */
+
+/*
+ * What a parked coroutine is waited for with. Others access it
+ * while the coroutine is switched out, so it is a part of struct
+ * coro rather than of the coroutine stack - the stack of a small
+ * coroutine is not in place then.
+ */
+
+/** A coroutine waiting on a synchronization primitive. */
+struct coro_waiter {
+	struct coro *coro;
+	/** Channel message, being sent or received. */
+	void *msg;
+	/** True, if the waker has done what was waited for. */
+	bool is_done;
+	struct coro_waiter *next;
+};
+
+/** A sleeping coroutine in a timer wheel. */
+struct coro_timer {
+	/** Wheel tick to wake up at. */
+	uint64_t expire;
+	struct coro *coro;
+	struct coro_timer *next;
+};
+
+struct coro_sched;
+struct coro_batch;
+
 /** Main coroutine structure, its context. */
 struct coro {
 	/** A value, returned by func. */
 	int ret;
 	/** Stack, used by the coroutine. */
 	void *stack;
+	/** Usable size of the stack, without the guard page. */
+	size_t stack_size;
 	/** An argument for the function func. */
 	void *func_arg;
 	/** A function to call as a coroutine. */
 	coro_f func;
+#if CORO_SWITCH_ASM
+	/** Stack pointer of the last remembered context. */
+	void *ctx;
+#else
 	/** Last remembered coroutine context. */
 	sigjmp_buf ctx;
+#endif
 	/** True, if the coroutine has finished. */
 	bool is_finished;
 	long long switch_count;
-	/** Links in the coroutine list, used by scheduler. */
-	struct coro *next, *prev;
+	/** Time slice in runtime clock ticks, 0 if not limited. */
+	uint64_t quantum;
+	/** Run queue wait in ticks, which is a miss, 0 if none. */
+	uint64_t latency_target;
+	/** True, if the quantum is adapted to the latency target. */
+	bool is_quantum_adaptive;
+	/** When the coroutine got queued, with a latency target. */
+	uint64_t queued_at;
+	/** Runs after a wait longer than the latency target. */
+	long long latency_miss_count;
+	/** Priority, CORO_PRIO_MIN is the most important. */
+	int prio;
+	/**
+	 * Runtime, weighted by the priority. Is accounted by the
+	 * fair share policy only.
+	 */
+	uint64_t vruntime;
+	/** Sequence number, for the statistics. */
+	long id;
+	/**
+	 * Statistics in runtime clock ticks, collected only when
+	 * enabled. See struct coro_stats.
+	 */
+	uint64_t cpu_time;
+	uint64_t wait_time;
+	uint64_t park_time;
+	uint64_t max_latency;
+	long long run_count;
+	/** When the coroutine has left a thread or got queued. */
+	uint64_t state_start;
+	struct coro_waiter waiter;
+	struct coro_timer timer;
+	/**
+	 * Scheduler of a small coroutine, which runs on its shared
+	 * stack. Such coroutines are never stolen by other threads.
+	 * NULL for the ones with own stacks.
+	 */
+	struct coro_sched *home;
+	/**
+	 * Saved live part of the stack of a small coroutine, from
+	 * the saved stack pointer up to the top of the shared stack.
+	 */
+	void *copy;
+	size_t copy_size;
+	size_t copy_capacity;
+	/** Pointer result, see coro_set_result(). */
+	void *result;
+	/** Coroutine-local storage, see coro_local_get(). */
+	void *local[CORO_LOCAL_SLOTS];
+	/**
+	 * The coroutine parked in coro_join() on this one. It and
+	 * the two flags below are protected by the completion
+	 * queue lock in the multi-threaded mode.
+	 */
+	struct coro *joiner;
+	/** True, if coro_join() has taken the coroutine over. */
+	bool is_joined;
+	/** True, if it has finished and left its thread for good. */
+	bool is_done;
+	/**
+	 * Batch the struct and the stack are carved from, see
+	 * coro_new_batch(). NULL for the ones allocated alone.
+	 */
+	struct coro_batch *batch;
+	/**
+	 * Link in a run queue of a scheduler, or in the completion
+	 * queue once finished.
+	 */
+	struct coro *next;
+};
+
+/**
+ * What to do with a coroutine which has just left a thread. It
+ * can't be done before the switch - in the multi-threaded mode
+ * another thread could pick the coroutine up while its context is
+ * not saved yet. So it is done by whoever runs next on the same
+ * thread.
+ */
+enum coro_leave {
+	CORO_LEAVE_NONE,
+	/** Put it back into the run queue. */
+	CORO_LEAVE_YIELD,
+	/** Hand it over to coro_sched_wait(). */
+	CORO_LEAVE_FINISH,
+	/**
+	 * Keep it out of the run queues until someone wakes it up.
+	 * The scheduler's park callback is called, if set.
+	 */
+	CORO_LEAVE_PARK,
+};
+
+enum {
+	CORO_PRIO_COUNT = CORO_PRIO_MAX - CORO_PRIO_MIN + 1,
+	/** Weight of the priority 0 in the fair share policy. */
+	CORO_WEIGHT_DEFAULT = 1024,
+	/**
+	 * The shortest adapted quantum. Below it the switches would
+	 * take a noticeable share of the time.
+	 */
+	CORO_ADAPT_MIN_QUANTUM_US = 5,
+	/** Gain of the adaptive quanta, which changes nothing. */
+	CORO_ADAPT_GAIN_ONE = 1024,
+};
+
+/**
+ * Weights of the priorities for the fair share policy, from the
+ * Linux CFS. Each next priority gets about 10% less CPU than the
+ * previous one, when both compete.
+ */
+static const uint32_t coro_prio_weights[CORO_PRIO_COUNT] = {
+	88761, 71755, 56483, 46273, 36291,
+	29154, 23254, 18705, 14949, 11916,
+	9548, 7620, 6100, 4904, 3906,
+	3121, 2501, 1991, 1586, 1277,
+	1024, 820, 655, 526, 423,
+	335, 272, 215, 172, 137,
+	110, 87, 70, 56, 45,
+	36, 29, 23, 18, 15,
+};
+
+/**
+ * Hierarchical timer wheel. A level has 64 slots, each next level
+ * is 64 times coarser. With 16us ticks the levels cover 1ms, 65ms,
+ * 4s and 4.7 min, later timers wait in the last slot and are
+ * placed again when it comes. Timers of a slot of an upper level
+ * are moved down when the wheel time reaches the slot.
+ */
+enum {
+	CORO_TIMER_TICK_US = 16,
+	CORO_TIMER_BITS = 6,
+	CORO_TIMER_SLOTS = 1 << CORO_TIMER_BITS,
+	CORO_TIMER_LEVELS = 4,
+};
+
+/**
+ * Scheduler of one thread. In the single-threaded mode there is
+ * one, owned by the thread which called coro_sched_init(). In the
+ * multi-threaded mode each worker thread has its own.
+ */
+struct coro_sched {
+	/**
+	 * Context of the thread itself. It runs the scheduler loop
+	 * - picks runnable coroutines and catches the dead ones.
+	 */
+	struct coro loop;
+	/** Which coroutine works at this moment on the thread. */
+	struct coro *this;
+	/** The coroutine which has just left the thread, and why. */
+	struct coro *prev;
+	enum coro_leave prev_leave;
+	/** Called for a parked coroutine once it is switched out. */
+	void (*park_cb)(struct coro *c, void *arg);
+	void *park_arg;
+	/**
+	 * Runnable coroutines, ordered by the policy. Round-robin
+	 * uses one FIFO, the priority policy - a FIFO per priority
+	 * and a bitmap of the non-empty ones, the fair share - a
+	 * min-heap by virtual runtime.
+	 */
+	struct coro *runq_head, *runq_tail;
+	struct coro *prio_head[CORO_PRIO_COUNT];
+	struct coro *prio_tail[CORO_PRIO_COUNT];
+	uint64_t prio_mask;
+	struct coro **heap;
+	int heap_capacity;
+	int runq_count;
+	/**
+	 * Virtual runtime, below which coroutines are not queued,
+	 * so the ones which have slept for long do not take the
+	 * thread over.
+	 */
+	uint64_t min_vruntime;
+	/** Runtime clock value, when 'this' was switched to. */
+	uint64_t slice_start;
+	/** Since when 'this' is not charged with virtual runtime. */
+	uint64_t vruntime_start;
+	/** Run queue waits of the coroutines, see coro_stats(). */
+	uint64_t latency_hist[CORO_LATENCY_BUCKETS];
+	/**
+	 * Scale of the adaptive quanta, CORO_ADAPT_GAIN_ONE is 1. See
+	 * coro_latency_adapt().
+	 */
+	uint64_t latency_gain;
+	/** Time the thread has run coroutines, not its loop. */
+	uint64_t busy_time;
+	/** Switches to coroutines, other than the loop. */
+	long long run_count;
+	/** Coroutines taken from the other workers. */
+	long long steal_count;
+	/**
+	 * Stack, shared by the small coroutines of this scheduler,
+	 * and the one whose frames are on it. They are saved only
+	 * when another small coroutine needs the stack.
+	 */
+	void *small_stack;
+	size_t small_stack_size;
+	char *small_top;
+	struct coro *small_owner;
+	/**
+	 * A small coroutine can't load another one onto the stack
+	 * it runs on. It switches to the loop instead, which does
+	 * that and switches to the coroutine left here.
+	 */
+	struct coro *small_next;
+	/** Small coroutines in the run queue, they can't be stolen. */
+	int runq_small_count;
+	/**
+	 * Protects the run queue from other workers, which steal
+	 * from it. Is not used in the single-threaded mode.
+	 */
+	pthread_mutex_t runq_lock;
+	pthread_t thread;
+	/**
+	 * Event loop, created on the first I/O. Has descriptors
+	 * the parked coroutines wait for, and the eventfd, which
+	 * interrupts the waiting.
+	 */
+	int epfd;
+	int evfd;
+	/** Coroutines of this scheduler parked on I/O. */
+	int io_wait_count;
+	/** Yields since the last non-blocking event loop poll. */
+	int io_poll_tick;
+	/** True while the thread is blocked in the event loop. */
+	bool is_polling;
+	/**
+	 * Coroutines, whose I/O is completed by the offload
+	 * threads. Protected by the io lock.
+	 */
+	struct coro *inbox_head;
+	pthread_mutex_t io_lock;
+	/**
+	 * Sleeping coroutines of this scheduler. Only its own
+	 * thread touches the wheel.
+	 */
+	struct coro_timer *timer_slots[CORO_TIMER_LEVELS][CORO_TIMER_SLOTS];
+	int timer_count;
+	/** Wheel tick, up to which the timers are fired. */
+	uint64_t timer_now;
+	/** Runtime clock value, when the next wheel tick comes. */
+	uint64_t timer_next;
+	/** Runtime clock value, when the quantum of 'this' ends. */
+	uint64_t quantum_end;
 };
 
+/** The scheduler of the single-threaded mode. */
+static struct coro_sched coro_sched_main;
+/** Schedulers of all the threads, running coroutines. */
+static struct coro_sched *coro_scheds = NULL;
+static int coro_sched_count = 0;
+/** True, if coroutines are run by worker threads. */
+static bool coro_is_mt = false;
+static enum coro_policy coro_policy = CORO_POLICY_RR;
+static bool coro_stats_is_enabled = false;
+/** Run queue waits on the already deleted schedulers. */
+static uint64_t coro_latency_hist[CORO_LATENCY_BUCKETS];
+/** Source of coroutine sequence numbers. */
+static long coro_id_seq = 0;
 /**
- * Scheduler is a main coroutine - it catches and returns dead
- * ones to a user.
+ * Scheduler of the current thread. NULL in threads which do not
+ * run coroutines, like the main one in the multi-threaded mode.
  */
-static struct coro coro_sched;
+static __thread struct coro_sched *coro_sched_ptr = NULL;
+/** Number of created and not yet finished coroutines. */
+static long coro_alive_count = 0;
 /**
- * True, if in that moment the scheduler is waiting for a
- * coroutine finish.
+ * Finished, but not yet returned by coro_sched_wait()
+ * coroutines, oldest first. The lock and the condition are used
+ * in the multi-threaded mode only.
  */
-static bool is_sched_waiting = false;
-/** Which coroutine works at this moment. */
-static struct coro *coro_this_ptr = NULL;
-/** List of all the coroutines. */
-static struct coro *coro_list = NULL;
+static struct coro *coro_done_head = NULL;
+static struct coro *coro_done_tail = NULL;
+static pthread_mutex_t coro_done_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t coro_done_cond = PTHREAD_COND_INITIALIZER;
+/** Workers without anything to run sleep here. */
+static pthread_mutex_t coro_idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t coro_idle_cond = PTHREAD_COND_INITIALIZER;
+static int coro_idle_count = 0;
+static bool coro_is_stopping = false;
+enum {
+	/** Yields between non-blocking polls of the event loop. */
+	CORO_IO_POLL_INTERVAL = 64,
+	/** Threads doing blocking I/O for the coroutines. */
+	CORO_IO_THREAD_COUNT = 4,
+};
+/** Next worker to get a coroutine created outside of workers. */
+static unsigned coro_spawn_cursor = 0;
+#if ! CORO_SWITCH_ASM
 /**
  * Buffer, used by the coroutine constructor to escape from the
  * signal handler back into the constructor to rollback
  * sigaltstack etc.
  */
-static sigjmp_buf start_point;
+static __thread sigjmp_buf start_point;
+/** The coroutine being created, for the signal handler. */
+static __thread struct coro *coro_body_arg = NULL;
+/** Signal disposition is per process, creations are serialized. */
+static pthread_mutex_t coro_body_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/**
+ * Coroutine stacks are mmap-ed with MAP_NORESERVE, so physical
+ * pages are committed only when touched, and have a PROT_NONE
+ * guard page below them to turn an overflow into SIGSEGV instead
+ * of a silent corruption. Sizes are rounded up to a power of two
+ * pages. Freed stacks are cached in per-size free lists, linked
+ * through a node at the top of each stack - that page is usually
+ * already committed.
+ */
+enum {
+	CORO_STACK_DEFAULT_SIZE = 1024 * 1024,
+	/** Stack of the small coroutines of one scheduler. */
+	CORO_SMALL_STACK_SIZE = 256 * 1024,
+	/**
+	 * Without the assembly backend small coroutines just get
+	 * small stacks of their own.
+	 */
+	CORO_SMALL_STACK_FALLBACK_SIZE = 32 * 1024,
+	/** Stacks per size class kept cached, the rest are unmapped. */
+	CORO_STACK_POOL_MAX = 1024,
+	CORO_STACK_CLASS_COUNT = 48,
+};
+
+struct coro_stack_node {
+	struct coro_stack_node *next;
+};
+
+struct coro_stack_pool {
+	struct coro_stack_node *head;
+	int count;
+};
+
+static struct coro_stack_pool coro_stack_pools[CORO_STACK_CLASS_COUNT];
+static size_t coro_page_size = 0;
+/** Stacks are created and deleted by any thread. */
+static pthread_mutex_t coro_stack_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Round @a size up to a power of two pages and return index of
+ * that size class.
+ */
+static int
+coro_stack_class(size_t *size)
+{
+	if (coro_page_size == 0)
+		coro_page_size = sysconf(_SC_PAGESIZE);
+	size_t pages = (*size + coro_page_size - 1) / coro_page_size;
+	int cls = 0;
+	while (((size_t)1 << cls) < pages)
+		++cls;
+	*size = ((size_t)1 << cls) * coro_page_size;
+	return cls;
+}
+
+static inline struct coro_stack_node *
+coro_stack_node(void *stack, size_t size)
+{
+	return (struct coro_stack_node *)((char *)stack + size) - 1;
+}
+
+/**
+ * Take a stack of at least @a size bytes from the pool, or map a
+ * new one. The real size is returned via @a size.
+ */
+static void *
+coro_stack_new(size_t *size)
+{
+	pthread_mutex_lock(&coro_stack_lock);
+	int cls = coro_stack_class(size);
+	struct coro_stack_pool *pool = &coro_stack_pools[cls];
+	struct coro_stack_node *node = pool->head;
+	if (node != NULL) {
+		pool->head = node->next;
+		--pool->count;
+	}
+	pthread_mutex_unlock(&coro_stack_lock);
+	if (node != NULL)
+		return (char *)(node + 1) - *size;
+	char *map = mmap(NULL, *size + coro_page_size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (map == MAP_FAILED)
+		handle_error();
+	if (mprotect(map, coro_page_size, PROT_NONE) != 0)
+		handle_error();
+	return map + coro_page_size;
+}
+
+/** Return the stack into the pool. */
+static void
+coro_stack_delete(void *stack, size_t size)
+{
+	pthread_mutex_lock(&coro_stack_lock);
+	int cls = coro_stack_class(&size);
+	struct coro_stack_pool *pool = &coro_stack_pools[cls];
+	bool is_cached = pool->count < CORO_STACK_POOL_MAX;
+	if (is_cached) {
+		struct coro_stack_node *node = coro_stack_node(stack, size);
+		node->next = pool->head;
+		pool->head = node;
+		++pool->count;
+	}
+	pthread_mutex_unlock(&coro_stack_lock);
+	if (! is_cached && munmap((char *)stack - coro_page_size,
+				  size + coro_page_size) != 0)
+		handle_error();
+}
+
+/**
+ * Coroutines created by coro_new_batch(). Their structs are one
+ * allocation, and their stacks are one mapping, with a guard page
+ * below each stack. Both are freed when the last coroutine of the
+ * batch is deleted.
+ */
+struct coro_batch {
+	/** Coroutines of the batch not deleted yet. */
+	size_t ref_count;
+	char *map;
+	size_t map_size;
+	struct coro coros[];
+};
 
-/** Add a new coroutine to the beginning of the list. */
+/** Drop a reference to the batch, free it with the last one. */
 static void
-coro_list_add(struct coro *c)
+coro_batch_unref(struct coro_batch *b)
 {
-	c->next = coro_list;
-	c->prev = NULL;
-	if (coro_list != NULL)
-		coro_list->prev = c;
-	coro_list = c;
+	if (__atomic_sub_fetch(&b->ref_count, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+	if (munmap(b->map, b->map_size) != 0)
+		handle_error();
+	free(b);
 }
 
-/** Remove a coroutine from the list. */
+/** Unmap all the cached stacks. */
 static void
-coro_list_delete(struct coro *c)
+coro_stack_pool_trim(void)
 {
-	struct coro *prev = c->prev, *next = c->next;
-	if (prev != NULL)
-		prev->next = next;
-	if (next != NULL)
-		next->prev = prev;
-	if (prev == NULL)
-		coro_list = next;
+	pthread_mutex_lock(&coro_stack_lock);
+	for (int cls = 0; cls < CORO_STACK_CLASS_COUNT; ++cls) {
+		struct coro_stack_pool *pool = &coro_stack_pools[cls];
+		size_t size = ((size_t)1 << cls) * coro_page_size;
+		while (pool->head != NULL) {
+			struct coro_stack_node *node = pool->head;
+			pool->head = node->next;
+			char *stack = (char *)(node + 1) - size;
+			if (munmap(stack - coro_page_size,
+				   size + coro_page_size) != 0)
+				handle_error();
+		}
+		pool->count = 0;
+	}
+	pthread_mutex_unlock(&coro_stack_lock);
 }
 
-int
-coro_status(const struct coro *c)
+/**
+ * Runtime clock. Its ticks are TSC cycles on x86-64 with an
+ * invariant TSC, the virtual counter on AArch64, and nanoseconds
+ * of CLOCK_MONOTONIC otherwise. Reading a counter is an
+ * instruction, cheap enough to check a time slice in tight loops.
+ */
+enum {
+	/** How long to measure the TSC frequency. */
+	CORO_CLOCK_CALIBRATION_NS = 2 * 1000 * 1000,
+};
+
+static double coro_ticks_per_us = 1000;
+/** True, if the ticks are read from a hardware counter. */
+static bool coro_clock_is_counter = false;
+/** Clock value at the calibration, coro_time_us() counts from it. */
+static uint64_t coro_clock_base = 0;
+/** Runtime clock ticks to a wheel tick. */
+static int coro_timer_shift = 0;
+static pthread_once_t coro_clock_once = PTHREAD_ONCE_INIT;
+
+static uint64_t
+coro_clock_ns(void)
 {
-	return c->ret;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-long long
-coro_switch_count(const struct coro *c)
+static inline uint64_t
+coro_clock(void)
 {
-	return c->switch_count;
+#if defined(__x86_64__)
+	if (coro_clock_is_counter)
+		return __rdtsc();
+#elif defined(__aarch64__)
+	if (coro_clock_is_counter) {
+		uint64_t value;
+		__asm__ volatile("mrs %0, cntvct_el0" : "=r"(value));
+		return value;
+	}
+#endif
+	return coro_clock_ns();
 }
 
-bool
-coro_is_finished(const struct coro *c)
+static void
+coro_clock_calibrate(void)
 {
-	return c->is_finished;
+#if defined(__x86_64__)
+	unsigned eax, ebx, ecx, edx;
+	/* Without an invariant TSC the frequency can change. */
+	if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) != 0 &&
+	    (edx & (1 << 8)) != 0) {
+		uint64_t ns_start = coro_clock_ns();
+		uint64_t tsc_start = __rdtsc();
+		uint64_t ns_end;
+		do {
+			ns_end = coro_clock_ns();
+		} while (ns_end - ns_start < CORO_CLOCK_CALIBRATION_NS);
+		uint64_t tsc_end = __rdtsc();
+		coro_ticks_per_us = (double)(tsc_end - tsc_start) * 1000 /
+				    (ns_end - ns_start);
+		coro_clock_is_counter = true;
+	}
+#elif defined(__aarch64__)
+	uint64_t freq;
+	__asm__ volatile("mrs %0, cntfrq_el0" : "=r"(freq));
+	if (freq != 0) {
+		coro_ticks_per_us = (double)freq / 1000000;
+		coro_clock_is_counter = true;
+	}
+#endif
+	coro_clock_base = coro_clock();
+	double tick = coro_ticks_per_us * CORO_TIMER_TICK_US;
+	while ((double)((uint64_t)1 << coro_timer_shift) < tick)
+		++coro_timer_shift;
 }
 
-void
-coro_delete(struct coro *c)
+static inline void
+coro_clock_init(void)
 {
-	free(c->stack);
-	free(c);
+	pthread_once(&coro_clock_once, coro_clock_calibrate);
+}
+
+static inline uint64_t
+coro_us_to_ticks(uint64_t us)
+{
+	return (uint64_t)(us * coro_ticks_per_us);
 }
 
-/** Switch the current coroutine to an arbitrary one. */
+uint64_t
+coro_time_us(void)
+{
+	coro_clock_init();
+	return (uint64_t)((coro_clock() - coro_clock_base) /
+			  coro_ticks_per_us);
+}
+
+/**
+ * Scheduler of the current thread. A coroutine can migrate to
+ * another thread during a switch, while the compiler is free to
+ * cache a TLS address within a function. Always getting the
+ * scheduler via this opaque call after a switch forces a fresh
+ * read.
+ */
+static __attribute__((noinline)) struct coro_sched *
+coro_sched_self(void)
+{
+	__asm__ volatile("" ::: "memory");
+	return coro_sched_ptr;
+}
+
+static inline void
+coro_runq_lock(struct coro_sched *s)
+{
+	if (coro_is_mt)
+		pthread_mutex_lock(&s->runq_lock);
+}
+
+static inline void
+coro_runq_unlock(struct coro_sched *s)
+{
+	if (coro_is_mt)
+		pthread_mutex_unlock(&s->runq_lock);
+}
+
+/** The coroutine is queued - it is not parked anymore. */
+static inline void
+coro_stats_push(struct coro *c)
+{
+	uint64_t now = coro_clock();
+	c->park_time += now - c->state_start;
+	c->state_start = now;
+}
+
+/**
+ * The thread switches from its current coroutine to @a to - the
+ * former has run since the slice start, the latter has waited in
+ * a run queue since it was queued.
+ */
 static void
-coro_yield_to(struct coro *to)
+coro_stats_switch(struct coro_sched *s, struct coro *to, uint64_t now)
 {
-	struct coro *from = coro_this_ptr;
-	++from->switch_count;
-	if (sigsetjmp(from->ctx, 0) == 0)
-		siglongjmp(to->ctx, 1);
-	coro_this_ptr = from;
+	struct coro *from = s->this;
+	from->cpu_time += now - s->slice_start;
+	from->state_start = now;
+	if (from != &s->loop)
+		s->busy_time += now - s->slice_start;
+	if (to != &s->loop)
+		++s->run_count;
+	uint64_t wait = now - to->state_start;
+	to->wait_time += wait;
+	++to->run_count;
+	if (wait > to->max_latency)
+		to->max_latency = wait;
+	uint64_t us = (uint64_t)(wait / coro_ticks_per_us);
+	int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+	if (bucket >= CORO_LATENCY_BUCKETS)
+		bucket = CORO_LATENCY_BUCKETS - 1;
+	++s->latency_hist[bucket];
 }
 
-void
-coro_yield(void)
+/**
+ * Same as coro_stats_switch() with the statistics off, but only
+ * for the coroutines with a latency target, and without the
+ * histogram. Their queueing time is known anyway, so the run
+ * queue waits and the running times cost no more clock reads.
+ */
+static void
+coro_latency_switch(struct coro_sched *s, struct coro *to, uint64_t now)
 {
-	struct coro *from = coro_this_ptr;
-	struct coro *to = from->next;
-	if (to == NULL)
-		coro_yield_to(&coro_sched);
+	struct coro *from = s->this;
+	if (from->latency_target != 0) {
+		from->cpu_time += now - s->slice_start;
+		s->busy_time += now - s->slice_start;
+	}
+	if (to->latency_target != 0) {
+		uint64_t wait = now - to->queued_at;
+		to->wait_time += wait;
+		++to->run_count;
+		++s->run_count;
+		if (wait > to->max_latency)
+			to->max_latency = wait;
+	}
+}
+
+static inline void
+coro_list_push(struct coro **head, struct coro **tail, struct coro *c)
+{
+	c->next = NULL;
+	if (*tail != NULL)
+		(*tail)->next = c;
 	else
-		coro_yield_to(to);
+		*head = c;
+	*tail = c;
 }
 
-void
-coro_sched_init(void)
+static inline struct coro *
+coro_list_pop(struct coro **head, struct coro **tail)
 {
-	memset(&coro_sched, 0, sizeof(coro_sched));
-	coro_this_ptr = &coro_sched;
+	struct coro *c = *head;
+	*head = c->next;
+	if (*head == NULL)
+		*tail = NULL;
+	c->next = NULL;
+	return c;
 }
 
-struct coro *
-coro_sched_wait(void)
+static void
+coro_heap_push(struct coro_sched *s, struct coro *c)
+{
+	if (s->runq_count == s->heap_capacity) {
+		int capacity = s->heap_capacity > 0 ? 2 * s->heap_capacity : 64;
+		size_t size = capacity * sizeof(*s->heap);
+		/* Not realloc(NULL) - heap_help does not trace it right. */
+		struct coro **heap = s->heap != NULL ? realloc(s->heap, size) :
+						       malloc(size);
+		if (heap == NULL)
+			handle_error();
+		s->heap = heap;
+		s->heap_capacity = capacity;
+	}
+	int i = s->runq_count;
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+		if (s->heap[parent]->vruntime <= c->vruntime)
+			break;
+		s->heap[i] = s->heap[parent];
+		i = parent;
+	}
+	s->heap[i] = c;
+}
+
+/**
+ * Take the coroutine at @a pos out of the heap. The last one
+ * fills the hole and goes up or down from there - only one of the
+ * loops moves it.
+ */
+static struct coro *
+coro_heap_remove(struct coro_sched *s, int pos)
+{
+	struct coro *top = s->heap[pos];
+	struct coro *last = s->heap[s->runq_count - 1];
+	int size = s->runq_count - 1;
+	int i = pos;
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+		if (s->heap[parent]->vruntime <= last->vruntime)
+			break;
+		s->heap[i] = s->heap[parent];
+		i = parent;
+	}
+	while (true) {
+		int child = 2 * i + 1;
+		if (child >= size)
+			break;
+		if (child + 1 < size &&
+		    s->heap[child + 1]->vruntime < s->heap[child]->vruntime)
+			++child;
+		if (last->vruntime <= s->heap[child]->vruntime)
+			break;
+		s->heap[i] = s->heap[child];
+		i = child;
+	}
+	if (pos < size)
+		s->heap[i] = last;
+	return top;
+}
+
+static inline struct coro *
+coro_heap_pop(struct coro_sched *s)
+{
+	return coro_heap_remove(s, 0);
+}
+
+/** Add a coroutine to the run queue. The queue is locked. */
+static inline void
+coro_runq_push(struct coro_sched *s, struct coro *c)
+{
+	switch (coro_policy) {
+	case CORO_POLICY_RR:
+		coro_list_push(&s->runq_head, &s->runq_tail, c);
+		break;
+	case CORO_POLICY_PRIO: {
+		int i = c->prio - CORO_PRIO_MIN;
+		coro_list_push(&s->prio_head[i], &s->prio_tail[i], c);
+		s->prio_mask |= (uint64_t)1 << i;
+		break;
+	}
+	case CORO_POLICY_FAIR:
+		if (c->vruntime < s->min_vruntime)
+			c->vruntime = s->min_vruntime;
+		coro_heap_push(s, c);
+		break;
+	}
+	++s->runq_count;
+	s->runq_small_count += c->home != NULL;
+	if (c->latency_target != 0)
+		c->queued_at = coro_clock();
+	if (coro_stats_is_enabled)
+		coro_stats_push(c);
+}
+
+/**
+ * Take the coroutine which should run next by the policy. The
+ * queue is locked.
+ */
+static inline struct coro *
+coro_runq_pop(struct coro_sched *s)
+{
+	if (s->runq_count == 0)
+		return NULL;
+	struct coro *c = NULL;
+	switch (coro_policy) {
+	case CORO_POLICY_RR:
+		c = coro_list_pop(&s->runq_head, &s->runq_tail);
+		break;
+	case CORO_POLICY_PRIO: {
+		int i = __builtin_ctzll(s->prio_mask);
+		c = coro_list_pop(&s->prio_head[i], &s->prio_tail[i]);
+		if (s->prio_head[i] == NULL)
+			s->prio_mask &= ~((uint64_t)1 << i);
+		break;
+	}
+	case CORO_POLICY_FAIR:
+		c = coro_heap_pop(s);
+		if (c->vruntime > s->min_vruntime)
+			s->min_vruntime = c->vruntime;
+		break;
+	}
+	--s->runq_count;
+	s->runq_small_count -= c->home != NULL;
+	return c;
+}
+
+/**
+ * Take the coroutine to run instead of @a cur, which yields, or
+ * NULL if @a cur should go on by the policy: the priority one
+ * keeps running while the others are less important, the fair
+ * share one - while it has the smallest virtual runtime. The
+ * queue is locked.
+ */
+static inline struct coro *
+coro_runq_pop_other(struct coro_sched *s, struct coro *cur)
+{
+	if (s->runq_count == 0)
+		return NULL;
+	switch (coro_policy) {
+	case CORO_POLICY_RR:
+		break;
+	case CORO_POLICY_PRIO:
+		if (__builtin_ctzll(s->prio_mask) > cur->prio - CORO_PRIO_MIN)
+			return NULL;
+		break;
+	case CORO_POLICY_FAIR:
+		if (s->heap[0]->vruntime > cur->vruntime)
+			return NULL;
+		break;
+	}
+	return coro_runq_pop(s);
+}
+
+/**
+ * Unlink the first coroutine of the list, which is not small, or
+ * return NULL if there is none.
+ */
+static inline struct coro *
+coro_list_pop_stealable(struct coro **head, struct coro **tail)
+{
+	struct coro *prev = NULL;
+	for (struct coro *c = *head; c != NULL; prev = c, c = c->next) {
+		if (c->home != NULL)
+			continue;
+		if (prev != NULL)
+			prev->next = c->next;
+		else
+			*head = c->next;
+		if (*tail == c)
+			*tail = prev;
+		c->next = NULL;
+		return c;
+	}
+	return NULL;
+}
+
+/**
+ * Take the coroutine for another thread: the one which should run
+ * next by the policy, skipping the small ones - they are bound to
+ * this thread. NULL if all are small. The queue is locked.
+ */
+static struct coro *
+coro_runq_steal(struct coro_sched *s)
+{
+	if (s->runq_count == s->runq_small_count)
+		return NULL;
+	struct coro *c = NULL;
+	switch (coro_policy) {
+	case CORO_POLICY_RR:
+		c = coro_list_pop_stealable(&s->runq_head, &s->runq_tail);
+		break;
+	case CORO_POLICY_PRIO:
+		for (uint64_t mask = s->prio_mask; c == NULL && mask != 0;
+		     mask &= mask - 1) {
+			int i = __builtin_ctzll(mask);
+			c = coro_list_pop_stealable(&s->prio_head[i],
+						    &s->prio_tail[i]);
+			if (s->prio_head[i] == NULL)
+				s->prio_mask &= ~((uint64_t)1 << i);
+		}
+		break;
+	case CORO_POLICY_FAIR: {
+		/* The least served of the ones, which are not small. */
+		int pos = -1;
+		for (int i = 0; i < s->runq_count; ++i) {
+			if (s->heap[i]->home == NULL && (pos < 0 ||
+			    s->heap[i]->vruntime < s->heap[pos]->vruntime))
+				pos = i;
+		}
+		c = coro_heap_remove(s, pos);
+		break;
+	}
+	}
+	--s->runq_count;
+	return c;
+}
+
+/**
+ * Charge the current coroutine of @a s for the time since it was
+ * switched to, by its priority weight. Only the fair share policy
+ * needs it.
+ */
+static inline void
+coro_account(struct coro_sched *s, uint64_t now)
+{
+	struct coro *c = s->this;
+	c->vruntime += (now - s->vruntime_start) * CORO_WEIGHT_DEFAULT /
+		       coro_prio_weights[c->prio - CORO_PRIO_MIN];
+	s->vruntime_start = now;
+}
+
+/**
+ * Put a timer into the wheel slot, which comes at its expiration
+ * or, for an upper level, at the moment to move it lower.
+ */
+static void
+coro_timer_place(struct coro_sched *s, struct coro_timer *t)
+{
+	uint64_t expire = t->expire;
+	uint64_t delta = expire - s->timer_now;
+	int level = 0;
+	while (level < CORO_TIMER_LEVELS - 1 &&
+	       delta >= (uint64_t)1 << (CORO_TIMER_BITS * (level + 1)))
+		++level;
+	/* Beyond the wheel - wait in its farthest slot. */
+	if ((delta >> (CORO_TIMER_BITS * CORO_TIMER_LEVELS)) != 0) {
+		expire = s->timer_now +
+			 ((uint64_t)1 << (CORO_TIMER_BITS * CORO_TIMER_LEVELS)) -
+			 1;
+	}
+	int slot = (expire >> (CORO_TIMER_BITS * level)) &
+		   (CORO_TIMER_SLOTS - 1);
+	t->next = s->timer_slots[level][slot];
+	s->timer_slots[level][slot] = t;
+}
+
+/**
+ * Advance the wheel to the current time and make the coroutines
+ * of the expired timers runnable.
+ */
+static void
+coro_timer_run(struct coro_sched *s)
 {
-	while (coro_list != NULL) {
-		for (struct coro *c = coro_list; c != NULL; c = c->next) {
-			if (c->is_finished) {
-				coro_list_delete(c);
-				return c;
+	uint64_t now = coro_clock() >> coro_timer_shift;
+	while (s->timer_count > 0 && s->timer_now < now) {
+		uint64_t tick = ++s->timer_now;
+		/*
+		 * Move timers down, starting from the highest level
+		 * whose slot has come, so they can end up right in the
+		 * slots being emptied below.
+		 */
+		int top = 0;
+		while (top < CORO_TIMER_LEVELS - 1 &&
+		       (tick & (((uint64_t)1 << (CORO_TIMER_BITS *
+						  (top + 1))) - 1)) == 0)
+			++top;
+		for (int level = top; level > 0; --level) {
+			int slot = (tick >> (CORO_TIMER_BITS * level)) &
+				   (CORO_TIMER_SLOTS - 1);
+			struct coro_timer *t = s->timer_slots[level][slot];
+			s->timer_slots[level][slot] = NULL;
+			while (t != NULL) {
+				struct coro_timer *next = t->next;
+				coro_timer_place(s, t);
+				t = next;
 			}
 		}
-		is_sched_waiting = true;
-		coro_yield_to(coro_list);
-		is_sched_waiting = false;
+		int slot = tick & (CORO_TIMER_SLOTS - 1);
+		struct coro_timer *t = s->timer_slots[0][slot];
+		s->timer_slots[0][slot] = NULL;
+		while (t != NULL) {
+			/*
+			 * The timer belongs to the sleeper, which can
+			 * run and sleep again right after the push.
+			 */
+			struct coro_timer *next = t->next;
+			if (t->expire > tick) {
+				coro_timer_place(s, t);
+			} else {
+				--s->timer_count;
+				coro_runq_lock(s);
+				coro_runq_push(s, t->coro);
+				coro_runq_unlock(s);
+			}
+			t = next;
+		}
 	}
-	return NULL;
+	if (s->timer_now < now)
+		s->timer_now = now;
+	s->timer_next = (s->timer_now + 1) << coro_timer_shift;
 }
 
-struct coro *
-coro_this(void)
+/** Fire the expired timers, if the next wheel tick has come. */
+static inline void
+coro_timer_check(struct coro_sched *s)
+{
+	if (s->timer_count > 0 && coro_clock() >= s->timer_next)
+		coro_timer_run(s);
+}
+
+/**
+ * Wheel tick of the nearest timer expiration or a move down of
+ * timers. The scheduler has timers.
+ */
+static uint64_t
+coro_timer_next(struct coro_sched *s)
+{
+	uint64_t next = UINT64_MAX;
+	for (int level = 0; level < CORO_TIMER_LEVELS; ++level) {
+		int shift = CORO_TIMER_BITS * level;
+		uint64_t pos = s->timer_now >> shift;
+		for (uint64_t i = 1; i <= CORO_TIMER_SLOTS; ++i) {
+			int slot = (pos + i) & (CORO_TIMER_SLOTS - 1);
+			if (s->timer_slots[level][slot] != NULL) {
+				if (((pos + i) << shift) < next)
+					next = (pos + i) << shift;
+				break;
+			}
+		}
+	}
+	return next;
+}
+
+/**
+ * Wake up the thread of the scheduler @a s, if it is blocked in
+ * its event loop.
+ */
+static void
+coro_io_interrupt(struct coro_sched *s)
+{
+	/* Pairs with the check in coro_io_poll(). */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (! __atomic_load_n(&s->is_polling, __ATOMIC_SEQ_CST))
+		return;
+	uint64_t one = 1;
+	if (write(s->evfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		handle_error();
+}
+
+/** Wake up one or all idle workers, if there are any. */
+static void
+coro_idle_wakeup(bool is_all)
+{
+	/*
+	 * Pairs with the increment in coro_worker_idle(): either
+	 * the worker sees the new work, or it is seen here as idle.
+	 */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&coro_idle_count, __ATOMIC_SEQ_CST) == 0)
+		return;
+	pthread_mutex_lock(&coro_idle_lock);
+	if (is_all)
+		pthread_cond_broadcast(&coro_idle_cond);
+	else
+		pthread_cond_signal(&coro_idle_cond);
+	pthread_mutex_unlock(&coro_idle_lock);
+}
+
+/**
+ * Make a coroutine runnable. It goes to the current thread's
+ * queue, or, outside of workers, to each worker in turn.
+ */
+static void
+coro_sched_push(struct coro *c)
+{
+	struct coro_sched *s = c->home != NULL ? c->home : coro_sched_self();
+	if (s == NULL) {
+		unsigned i = __atomic_fetch_add(&coro_spawn_cursor, 1,
+						__ATOMIC_RELAXED);
+		s = &coro_scheds[i % coro_sched_count];
+	}
+	coro_runq_lock(s);
+	coro_runq_push(s, c);
+	coro_runq_unlock(s);
+	if (coro_is_mt) {
+		/* Only its own thread can take a small coroutine. */
+		coro_idle_wakeup(c->home != NULL);
+		coro_io_interrupt(s);
+	}
+}
+
+static void
+coro_stats_record(const struct coro *c);
+
+/** Append a finished coroutine to the completion queue. */
+static void
+coro_done_push(struct coro *c)
+{
+	if (coro_is_mt)
+		pthread_mutex_lock(&coro_done_lock);
+	c->is_done = true;
+	/* A joined one goes to its joiner instead. */
+	if (c->is_joined) {
+		if (c->joiner != NULL)
+			coro_sched_push(c->joiner);
+	} else {
+		c->next = NULL;
+		if (coro_done_tail != NULL)
+			coro_done_tail->next = c;
+		else
+			coro_done_head = c;
+		coro_done_tail = c;
+	}
+	__atomic_sub_fetch(&coro_alive_count, 1, __ATOMIC_RELAXED);
+	if (coro_stats_is_enabled)
+		coro_stats_record(c);
+	if (coro_is_mt) {
+		/* coro_join() outside of coroutines waits here too. */
+		if (c->is_joined)
+			pthread_cond_broadcast(&coro_done_cond);
+		else
+			pthread_cond_signal(&coro_done_cond);
+		pthread_mutex_unlock(&coro_done_lock);
+	}
+}
+
+/**
+ * Take the oldest finished coroutine, or NULL. The queue is
+ * locked in the multi-threaded mode.
+ */
+static struct coro *
+coro_done_pop(void)
+{
+	struct coro *c = coro_done_head;
+	if (c == NULL)
+		return NULL;
+	coro_done_head = c->next;
+	if (coro_done_head == NULL)
+		coro_done_tail = NULL;
+	c->next = NULL;
+	return c;
+}
+
+/**
+ * Remove a finished coroutine from the completion queue. The
+ * queue is locked in the multi-threaded mode.
+ */
+static void
+coro_done_remove(struct coro *c)
+{
+	struct coro **link = &coro_done_head;
+	struct coro *prev = NULL;
+	while (*link != c) {
+		prev = *link;
+		link = &prev->next;
+	}
+	*link = c->next;
+	if (coro_done_tail == c)
+		coro_done_tail = prev;
+	c->next = NULL;
+}
+
+int
+coro_status(const struct coro *c)
+{
+	return c->ret;
+}
+
+void *
+coro_result(const struct coro *c)
+{
+	return c->result;
+}
+
+long long
+coro_switch_count(const struct coro *c)
+{
+	return c->switch_count;
+}
+
+bool
+coro_is_finished(const struct coro *c)
+{
+	return c->is_finished;
+}
+
+void
+coro_delete(struct coro *c)
+{
+	free(c->copy);
+	if (c->batch != NULL) {
+		coro_batch_unref(c->batch);
+		return;
+	}
+	if (c->stack != NULL)
+		coro_stack_delete(c->stack, c->stack_size);
+	free(c);
+}
+
+const char *
+coro_switch_backend(void)
+{
+#if CORO_SWITCH_ASM && defined(__x86_64__)
+	return "asm-x86_64";
+#elif CORO_SWITCH_ASM
+	return "asm-aarch64";
+#else
+	return "sigjmp";
+#endif
+}
+
+/** Put the initial frame of a batch coroutine onto its stack. */
+static void
+coro_batch_prepare(struct coro *c);
+
+/**
+ * Save the context of @a from and restore the one of @a to. The
+ * bookkeeping around it is done by the callers.
+ */
+static inline void
+coro_ctx_jump(struct coro *from, struct coro *to)
+{
+#if CORO_SWITCH_ASM
+	if (to->ctx == NULL)
+		coro_batch_prepare(to);
+	coro_ctx_switch(&from->ctx, to->ctx);
+#else
+	if (sigsetjmp(from->ctx, 0) == 0)
+		siglongjmp(to->ctx, 1);
+#endif
+}
+
+/**
+ * Complete a switch on the thread it has landed on - deal with
+ * the coroutine which has left.
+ */
+static void
+coro_sched_after_switch(struct coro_sched *s)
+{
+	struct coro *prev = s->prev;
+	enum coro_leave leave = s->prev_leave;
+	s->prev = NULL;
+	s->prev_leave = CORO_LEAVE_NONE;
+	switch (leave) {
+	case CORO_LEAVE_NONE:
+		break;
+	case CORO_LEAVE_YIELD:
+		coro_runq_lock(s);
+		coro_runq_push(s, prev);
+		coro_runq_unlock(s);
+		break;
+	case CORO_LEAVE_FINISH:
+		coro_done_push(prev);
+		break;
+	case CORO_LEAVE_PARK:
+		if (s->park_cb != NULL) {
+			void (*cb)(struct coro *, void *) = s->park_cb;
+			s->park_cb = NULL;
+			cb(prev, s->park_arg);
+		}
+		break;
+	}
+}
+
+#if CORO_SWITCH_ASM
+
+/**
+ * Put the frames of the small coroutine @a c onto the shared
+ * stack of its scheduler, saving the ones of the previous owner.
+ * Can't be called on the shared stack itself.
+ */
+static void
+coro_small_load(struct coro_sched *s, struct coro *c)
+{
+	struct coro *owner = s->small_owner;
+	if (owner != NULL) {
+		size_t size = s->small_top - (char *)owner->ctx;
+		if (size > owner->copy_capacity) {
+			size_t capacity = (size + 63) & ~(size_t)63;
+			free(owner->copy);
+			owner->copy = malloc(capacity);
+			if (owner->copy == NULL)
+				handle_error();
+			owner->copy_capacity = capacity;
+		}
+		memcpy(owner->copy, owner->ctx, size);
+		owner->copy_size = size;
+	}
+	memcpy(s->small_top - c->copy_size, c->copy, c->copy_size);
+	s->small_owner = c;
+}
+
+#else /* ! CORO_SWITCH_ASM */
+
+static inline void
+coro_small_load(struct coro_sched *s, struct coro *c)
+{
+	/* Small coroutines have own stacks here. */
+	(void)s;
+	(void)c;
+}
+
+#endif /* ! CORO_SWITCH_ASM */
+
+/**
+ * Set the adapted quantum, within its bounds. It is half of the
+ * target at most: a coroutine, which is alone, would make the one
+ * waking up next to it wait for the whole slice.
+ */
+static inline void
+coro_latency_clamp(struct coro *c, uint64_t quantum)
+{
+	uint64_t min = coro_us_to_ticks(CORO_ADAPT_MIN_QUANTUM_US);
+	if (quantum > c->latency_target / 2)
+		quantum = c->latency_target / 2;
+	c->quantum = quantum > min ? quantum : min;
+}
+
+/**
+ * Count a miss of the latency target by @a c, which has just
+ * ended its wait in the run queue, and adapt its quantum, if it
+ * is adaptive. The ones queued after it wait for its slice and the
+ * slices of the ones in front of them, so the quantum is a share
+ * of the target by the queue length. The share is scaled by the
+ * gain of the thread, with a hysteresis: down by a quarter after
+ * a wait above 7/8 of the target, up by 1/16 after one below 3/4,
+ * held in between. So the slices are as long as the target lets
+ * them be - the switches are few - and shrink before the waits
+ * miss it. The margin is for the overshoots of the slices and for
+ * the code, which can't yield.
+ */
+static inline void
+coro_latency_adapt(struct coro_sched *s, struct coro *c, uint64_t now)
+{
+	uint64_t wait = now - c->queued_at;
+	uint64_t target = c->latency_target;
+	if (wait > target)
+		++c->latency_miss_count;
+	if (! c->is_quantum_adaptive)
+		return;
+	uint64_t gain = s->latency_gain;
+	if (8 * wait > 7 * target)
+		gain -= gain / 4;
+	else if (4 * wait < 3 * target)
+		gain += gain / 16;
+	if (gain < CORO_ADAPT_GAIN_ONE / 8)
+		gain = CORO_ADAPT_GAIN_ONE / 8;
+	else if (gain > CORO_ADAPT_GAIN_ONE)
+		gain = CORO_ADAPT_GAIN_ONE;
+	s->latency_gain = gain;
+	int queued = __atomic_load_n(&s->runq_count, __ATOMIC_RELAXED);
+	coro_latency_clamp(c, target * gain / CORO_ADAPT_GAIN_ONE /
+			   (queued > 0 ? queued : 1));
+}
+
+/**
+ * Account a switch of the thread to @a to for the time slices,
+ * the fair share policy and the statistics.
+ */
+static inline void
+coro_switch_account(struct coro_sched *s, struct coro *to)
+{
+	if (to->quantum == 0 && to->latency_target == 0 &&
+	    s->this->latency_target == 0 &&
+	    coro_policy != CORO_POLICY_FAIR && ! coro_stats_is_enabled)
+		return;
+	uint64_t now = coro_clock();
+	if (coro_stats_is_enabled)
+		coro_stats_switch(s, to, now);
+	else
+		coro_latency_switch(s, to, now);
+	if (coro_policy == CORO_POLICY_FAIR)
+		coro_account(s, now);
+	if (to->latency_target != 0)
+		coro_latency_adapt(s, to, now);
+	s->slice_start = now;
+	s->vruntime_start = now;
+	s->quantum_end = now + to->quantum;
+}
+
+/**
+ * Switch the current thread from its current coroutine to
+ * @a to. @a leave tells what to do with the former.
+ */
+static void
+coro_switch(struct coro_sched *s, struct coro *to, enum coro_leave leave)
+{
+	struct coro *from = s->this;
+	s->prev = from;
+	s->prev_leave = leave;
+	if (to->home != NULL && s->small_owner != to) {
+		if (from->home != NULL) {
+			s->small_next = to;
+			to = &s->loop;
+		} else {
+			coro_small_load(s, to);
+		}
+	}
+	coro_switch_account(s, to);
+	s->this = to;
+	coro_ctx_jump(from, to);
+	/* Could be resumed by another thread. */
+	s = coro_sched_self();
+	coro_sched_after_switch(s);
+	/* The loop is asked to bring a small coroutine in. */
+	while (s->this == &s->loop && s->small_next != NULL) {
+		to = s->small_next;
+		s->small_next = NULL;
+		coro_small_load(s, to);
+		coro_switch_account(s, to);
+		s->prev = &s->loop;
+		s->prev_leave = CORO_LEAVE_NONE;
+		s->this = to;
+		coro_ctx_jump(&s->loop, to);
+		coro_sched_after_switch(s);
+	}
+}
+
+/**
+ * Suspend the current coroutine until it is made runnable again
+ * by somebody. @a cb, if not NULL, is called with @a arg once the
+ * coroutine is switched out - it is the earliest moment another
+ * thread can be allowed to wake it up.
+ */
+static void
+coro_park(struct coro_sched *s, void (*cb)(struct coro *, void *), void *arg)
+{
+	coro_runq_lock(s);
+	struct coro *to = coro_runq_pop(s);
+	coro_runq_unlock(s);
+	if (to == NULL)
+		to = &s->loop;
+	s->park_cb = cb;
+	s->park_arg = arg;
+	coro_switch(s, to, CORO_LEAVE_PARK);
+}
+
+static void
+coro_io_poll(struct coro_sched *s, int timeout);
+
+static void
+coro_io_drain_inbox(struct coro_sched *s);
+
+void
+coro_yield(void)
+{
+	struct coro_sched *s = coro_sched_self();
+	if (s == NULL || s->this == &s->loop)
+		return;
+	++s->this->switch_count;
+	/*
+	 * While coroutines are waiting for I/O, pick up the ones
+	 * done by offload threads - it is just a memory check -
+	 * and once in a while poll the descriptors.
+	 */
+	if (s->io_wait_count > 0) {
+		if (__atomic_load_n(&s->inbox_head, __ATOMIC_ACQUIRE) != NULL)
+			coro_io_drain_inbox(s);
+		if (++s->io_poll_tick >= CORO_IO_POLL_INTERVAL) {
+			s->io_poll_tick = 0;
+			coro_io_poll(s, 0);
+		}
+	}
+	coro_timer_check(s);
+	if (coro_policy == CORO_POLICY_FAIR)
+		coro_account(s, coro_clock());
+	coro_runq_lock(s);
+	struct coro *to = coro_runq_pop_other(s, s->this);
+	coro_runq_unlock(s);
+	/*
+	 * Nothing better to run here - keep going with a new quantum.
+	 * Nobody has waited, an adaptive one can grow.
+	 */
+	if (to == NULL) {
+		if (s->this->is_quantum_adaptive)
+			coro_latency_clamp(s->this, s->this->latency_target);
+		if (s->this->quantum != 0)
+			s->quantum_end = coro_clock() + s->this->quantum;
+		return;
+	}
+	coro_switch(s, to, CORO_LEAVE_YIELD);
+}
+
+/** Prepare a scheduler. */
+static void
+coro_sched_create(struct coro_sched *s)
+{
+	memset(s, 0, sizeof(*s));
+	s->latency_gain = CORO_ADAPT_GAIN_ONE;
+	pthread_mutex_init(&s->runq_lock, NULL);
+	pthread_mutex_init(&s->io_lock, NULL);
+	s->this = &s->loop;
+	s->epfd = -1;
+	s->evfd = -1;
+	s->timer_now = coro_clock() >> coro_timer_shift;
+	s->timer_next = (s->timer_now + 1) << coro_timer_shift;
+#if CORO_SWITCH_ASM
+	s->small_stack_size = CORO_SMALL_STACK_SIZE;
+	s->small_stack = coro_stack_new(&s->small_stack_size);
+	s->small_top = (char *)(((uintptr_t)s->small_stack +
+				 s->small_stack_size) & ~(uintptr_t)15);
+#endif
+}
+
+/** Free resources of a scheduler. */
+static void
+coro_sched_delete(struct coro_sched *s)
+{
+	pthread_mutex_destroy(&s->runq_lock);
+	pthread_mutex_destroy(&s->io_lock);
+	free(s->heap);
+	for (int i = 0; i < CORO_LATENCY_BUCKETS; ++i)
+		coro_latency_hist[i] += s->latency_hist[i];
+	if (s->epfd >= 0)
+		close(s->epfd);
+	if (s->evfd >= 0)
+		close(s->evfd);
+	if (s->small_stack != NULL)
+		coro_stack_delete(s->small_stack, s->small_stack_size);
+}
+
+static void
+coro_stats_init(void);
+
+void
+coro_sched_init(void)
+{
+	coro_clock_init();
+	coro_stats_init();
+	coro_sched_create(&coro_sched_main);
+	coro_sched_ptr = &coro_sched_main;
+	coro_scheds = &coro_sched_main;
+	coro_sched_count = 1;
+	coro_is_mt = false;
+	coro_alive_count = 0;
+	coro_done_head = NULL;
+	coro_done_tail = NULL;
+}
+
+/**
+ * Take a coroutine from another worker's queue. Victims are
+ * tried starting from the next worker, so thieves spread out.
+ */
+static struct coro *
+coro_sched_steal(struct coro_sched *self)
+{
+	int self_id = self - coro_scheds;
+	for (int i = 1; i < coro_sched_count; ++i) {
+		struct coro_sched *victim =
+			&coro_scheds[(self_id + i) % coro_sched_count];
+		coro_runq_lock(victim);
+		struct coro *c = coro_runq_steal(victim);
+		coro_runq_unlock(victim);
+		if (c != NULL)
+			return c;
+	}
+	return NULL;
+}
+
+/**
+ * Sleep until any work appears or the scheduler is stopped.
+ * Returns true in the latter case.
+ */
+static bool
+coro_worker_idle(struct coro_sched *self)
+{
+	pthread_mutex_lock(&coro_idle_lock);
+	__atomic_add_fetch(&coro_idle_count, 1, __ATOMIC_SEQ_CST);
+	bool has_work = false;
+	for (int i = 0; i < coro_sched_count && ! has_work; ++i) {
+		struct coro_sched *s = &coro_scheds[(self - coro_scheds + i) %
+						    coro_sched_count];
+		coro_runq_lock(s);
+		/* Small coroutines of others can't be stolen. */
+		has_work = s == self ? s->runq_count > 0 :
+				       s->runq_count > s->runq_small_count;
+		coro_runq_unlock(s);
+	}
+	if (! has_work && ! coro_is_stopping)
+		pthread_cond_wait(&coro_idle_cond, &coro_idle_lock);
+	__atomic_sub_fetch(&coro_idle_count, 1, __ATOMIC_SEQ_CST);
+	bool is_stopping = coro_is_stopping;
+	pthread_mutex_unlock(&coro_idle_lock);
+	return is_stopping;
+}
+
+/** Scheduler loop of a worker thread. */
+static void *
+coro_worker_f(void *arg)
+{
+	struct coro_sched *s = arg;
+	coro_sched_ptr = s;
+	while (true) {
+		coro_timer_check(s);
+		coro_runq_lock(s);
+		struct coro *c = coro_runq_pop(s);
+		coro_runq_unlock(s);
+		if (c == NULL && (c = coro_sched_steal(s)) != NULL)
+			++s->steal_count;
+		if (c != NULL)
+			coro_switch(s, c, CORO_LEAVE_NONE);
+		else if (s->io_wait_count > 0 || s->timer_count > 0)
+			coro_io_poll(s, -1);
+		else if (coro_worker_idle(s))
+			break;
+	}
+	return NULL;
+}
+
+void
+coro_sched_init_threads(int thread_count)
+{
+	if (thread_count < 1)
+		thread_count = 1;
+	coro_scheds = calloc(thread_count, sizeof(*coro_scheds));
+	if (coro_scheds == NULL)
+		handle_error();
+	coro_sched_count = thread_count;
+	coro_clock_init();
+	coro_stats_init();
+	coro_is_mt = true;
+	coro_is_stopping = false;
+	coro_alive_count = 0;
+	coro_done_head = NULL;
+	coro_done_tail = NULL;
+	coro_sched_ptr = NULL;
+	for (int i = 0; i < thread_count; ++i)
+		coro_sched_create(&coro_scheds[i]);
+	for (int i = 0; i < thread_count; ++i) {
+		struct coro_sched *s = &coro_scheds[i];
+		errno = pthread_create(&s->thread, NULL, coro_worker_f, s);
+		if (errno != 0)
+			handle_error();
+	}
+}
+
+static void
+coro_io_offload_stop(void);
+
+static void
+coro_stats_flush(void);
+
+void
+coro_sched_destroy(void)
+{
+	if (coro_is_mt) {
+		pthread_mutex_lock(&coro_idle_lock);
+		coro_is_stopping = true;
+		pthread_cond_broadcast(&coro_idle_cond);
+		pthread_mutex_unlock(&coro_idle_lock);
+		for (int i = 0; i < coro_sched_count; ++i)
+			pthread_join(coro_scheds[i].thread, NULL);
+		/* The threads are still there for the dump. */
+		coro_stats_flush();
+		for (int i = 0; i < coro_sched_count; ++i)
+			coro_sched_delete(&coro_scheds[i]);
+		free(coro_scheds);
+	} else if (coro_scheds != NULL) {
+		coro_stats_flush();
+		coro_sched_delete(&coro_sched_main);
+	}
+	coro_io_offload_stop();
+	coro_scheds = NULL;
+	coro_sched_count = 0;
+	coro_is_mt = false;
+	coro_policy = CORO_POLICY_RR;
+	coro_sched_ptr = NULL;
+	coro_stack_pool_trim();
+}
+
+struct coro *
+coro_sched_wait(void)
+{
+	if (coro_is_mt) {
+		pthread_mutex_lock(&coro_done_lock);
+		while (coro_done_head == NULL &&
+		       __atomic_load_n(&coro_alive_count, __ATOMIC_RELAXED) > 0)
+			pthread_cond_wait(&coro_done_cond, &coro_done_lock);
+		struct coro *c = coro_done_pop();
+		pthread_mutex_unlock(&coro_done_lock);
+		return c;
+	}
+	struct coro_sched *s = &coro_sched_main;
+	while (true) {
+		struct coro *c = coro_done_pop();
+		if (c != NULL)
+			return c;
+		coro_timer_check(s);
+		c = coro_runq_pop(s);
+		if (c != NULL)
+			coro_switch(s, c, CORO_LEAVE_NONE);
+		else if (s->io_wait_count > 0 || s->timer_count > 0)
+			coro_io_poll(s, -1);
+		else
+			return NULL;
+	}
+}
+
+struct coro *
+coro_this(void)
+{
+	struct coro_sched *s = coro_sched_self();
+	if (s == NULL || s->this == &s->loop)
+		return NULL;
+	return s->this;
+}
+
+void
+coro_sched_set_policy(enum coro_policy policy)
+{
+	if (__atomic_load_n(&coro_alive_count, __ATOMIC_RELAXED) > 0) {
+		printf("Critical error - can't change the policy with "
+		       "coroutines alive!\n");
+		exit(-1);
+	}
+	coro_policy = policy;
+	for (int i = 0; i < coro_sched_count; ++i)
+		coro_scheds[i].min_vruntime = 0;
+}
+
+void
+coro_set_priority(struct coro *c, int prio)
+{
+	if (prio < CORO_PRIO_MIN)
+		prio = CORO_PRIO_MIN;
+	else if (prio > CORO_PRIO_MAX)
+		prio = CORO_PRIO_MAX;
+	c->prio = prio;
+}
+
+int
+coro_priority(const struct coro *c)
+{
+	return c->prio;
+}
+
+uint64_t
+coro_vruntime_us(const struct coro *c)
+{
+	return (uint64_t)(c->vruntime / coro_ticks_per_us);
+}
+
+/**
+ * Statistics of the finished coroutines, kept for the dump. Are
+ * collected by coro_done_push() only when there is a dump path,
+ * so in the multi-threaded mode are protected by the completion
+ * queue lock. Are dumped and freed by coro_sched_destroy().
+ */
+struct coro_stats_record {
+	long id;
+	int status;
+	struct coro_stats stats;
+};
+
+enum {
+	/**
+	 * Records kept per scheduler, the ones past it are only
+	 * counted. A long running scheduler does not grow forever.
+	 */
+	CORO_STATS_RECORD_MAX = 1 << 16,
+};
+
+static struct coro_stats_record *coro_stats_records = NULL;
+static size_t coro_stats_record_count = 0;
+static size_t coro_stats_record_capacity = 0;
+static long long coro_stats_record_drop_count = 0;
+/** Where to dump the statistics, from LIBCORO_STATS. */
+static char *coro_stats_path = NULL;
+/** Whether a scheduler has dumped the statistics already. */
+static bool coro_stats_is_dumped = false;
+static pthread_once_t coro_stats_once = PTHREAD_ONCE_INIT;
+
+static inline uint64_t
+coro_ticks_to_us(uint64_t ticks)
+{
+	return (uint64_t)(ticks / coro_ticks_per_us);
+}
+
+void
+coro_stats(const struct coro *c, struct coro_stats *stats)
+{
+	uint64_t cpu_time = c->cpu_time;
+	/* The current coroutine has run since its slice start too. */
+	struct coro_sched *s = coro_sched_self();
+	if (s != NULL && s->this == c &&
+	    (coro_stats_is_enabled || c->latency_target != 0))
+		cpu_time += coro_clock() - s->slice_start;
+	stats->cpu_us = coro_ticks_to_us(cpu_time);
+	stats->wait_us = coro_ticks_to_us(c->wait_time);
+	stats->park_us = coro_ticks_to_us(c->park_time);
+	stats->max_latency_us = coro_ticks_to_us(c->max_latency);
+	stats->yield_count = c->switch_count;
+	stats->run_count = c->run_count;
+	stats->latency_miss_count = c->latency_miss_count;
+	stats->quantum_us = coro_ticks_to_us(c->quantum);
+}
+
+static void
+coro_stats_record(const struct coro *c)
+{
+	/* Nobody would see them. */
+	if (coro_stats_path == NULL)
+		return;
+	if (coro_stats_record_count == CORO_STATS_RECORD_MAX) {
+		++coro_stats_record_drop_count;
+		return;
+	}
+	if (coro_stats_record_count == coro_stats_record_capacity) {
+		size_t capacity = coro_stats_record_capacity > 0 ?
+				  2 * coro_stats_record_capacity : 64;
+		size_t size = capacity * sizeof(*coro_stats_records);
+		struct coro_stats_record *records =
+			coro_stats_records != NULL ?
+			realloc(coro_stats_records, size) : malloc(size);
+		if (records == NULL)
+			handle_error();
+		coro_stats_records = records;
+		coro_stats_record_capacity = capacity;
+	}
+	struct coro_stats_record *r =
+		&coro_stats_records[coro_stats_record_count++];
+	r->id = c->id;
+	r->status = c->ret;
+	coro_stats(c, &r->stats);
+}
+
+void
+coro_latency_histogram(uint64_t *hist)
+{
+	for (int i = 0; i < CORO_LATENCY_BUCKETS; ++i) {
+		hist[i] = coro_latency_hist[i];
+		for (int j = 0; j < coro_sched_count; ++j)
+			hist[i] += coro_scheds[j].latency_hist[i];
+	}
+}
+
+int
+coro_sched_thread_count(void)
+{
+	return coro_sched_count;
+}
+
+void
+coro_thread_stats(int thread, struct coro_thread_stats *stats)
+{
+	const struct coro_sched *s = &coro_scheds[thread];
+	stats->busy_us = coro_ticks_to_us(s->busy_time);
+	stats->run_count = s->run_count;
+	stats->steal_count = s->steal_count;
+}
+
+int
+coro_stats_dump(const char *path)
+{
+	FILE *f = strcmp(path, "-") == 0 ? stderr : fopen(path, "w");
+	if (f == NULL)
+		return -1;
+	static const char *policies[] = {"rr", "prio", "fair"};
+	fprintf(f, "{\n  \"backend\": \"%s\",\n  \"policy\": \"%s\",\n",
+		coro_switch_backend(), policies[coro_policy]);
+	fprintf(f, "  \"coroutines\": [");
+	for (size_t i = 0; i < coro_stats_record_count; ++i) {
+		const struct coro_stats_record *r = &coro_stats_records[i];
+		fprintf(f, "%s\n    {\"id\": %ld, \"status\": %d, "
+			"\"cpu_us\": %llu, \"wait_us\": %llu, "
+			"\"park_us\": %llu, \"max_latency_us\": %llu, "
+			"\"yields\": %lld, \"runs\": %lld, "
+			"\"latency_misses\": %lld, \"quantum_us\": %llu}",
+			i > 0 ? "," : "", r->id, r->status,
+			(unsigned long long)r->stats.cpu_us,
+			(unsigned long long)r->stats.wait_us,
+			(unsigned long long)r->stats.park_us,
+			(unsigned long long)r->stats.max_latency_us,
+			r->stats.yield_count, r->stats.run_count,
+			r->stats.latency_miss_count,
+			(unsigned long long)r->stats.quantum_us);
+	}
+	fprintf(f, "\n  ],\n  \"dropped\": %lld,\n  \"threads\": [",
+		coro_stats_record_drop_count);
+	for (int i = 0; i < coro_sched_count; ++i) {
+		struct coro_thread_stats stats;
+		coro_thread_stats(i, &stats);
+		fprintf(f, "%s\n    {\"busy_us\": %llu, \"runs\": %lld, "
+			"\"steals\": %lld}", i > 0 ? "," : "",
+			(unsigned long long)stats.busy_us, stats.run_count,
+			stats.steal_count);
+	}
+	fprintf(f, "\n  ],\n  \"latency_us_histogram\": [");
+	uint64_t hist[CORO_LATENCY_BUCKETS];
+	coro_latency_histogram(hist);
+	for (int i = 0; i < CORO_LATENCY_BUCKETS; ++i) {
+		fprintf(f, "%s\n    {\"below_us\": %llu, \"count\": %llu}",
+			i > 0 ? "," : "", 1ULL << i,
+			(unsigned long long)hist[i]);
+	}
+	fprintf(f, "\n  ]\n}\n");
+	if (f != stderr && fclose(f) != 0)
+		return -1;
+	return 0;
+}
+
+static void
+coro_stats_records_free(void)
+{
+	free(coro_stats_records);
+	coro_stats_records = NULL;
+	coro_stats_record_count = 0;
+	coro_stats_record_capacity = 0;
+	coro_stats_record_drop_count = 0;
+}
+
+/**
+ * Dump the statistics of the scheduler being destroyed, if there
+ * is a path, and forget its coroutines. The next scheduler
+ * overwrites the dump.
+ */
+static void
+coro_stats_flush(void)
+{
+	if (coro_stats_path != NULL) {
+		if (coro_stats_dump(coro_stats_path) != 0)
+			printf("Error %s\n", strerror(errno));
+		coro_stats_is_dumped = true;
+	}
+	coro_stats_records_free();
+}
+
+static void
+coro_stats_atexit(void)
+{
+	/* Not destroyed scheduler, or coroutines after it. */
+	if (!coro_stats_is_dumped || coro_stats_record_count > 0) {
+		if (coro_stats_dump(coro_stats_path) != 0)
+			printf("Error %s\n", strerror(errno));
+	}
+	free(coro_stats_path);
+	coro_stats_path = NULL;
+	coro_stats_records_free();
+}
+
+/** Turn the statistics on, if LIBCORO_STATS is set. */
+static void
+coro_stats_init_env(void)
+{
+	const char *path = getenv("LIBCORO_STATS");
+	if (path == NULL || *path == 0)
+		return;
+	coro_stats_path = strdup(path);
+	if (coro_stats_path == NULL)
+		handle_error();
+	coro_stats_is_enabled = true;
+	atexit(coro_stats_atexit);
+}
+
+static void
+coro_stats_init(void)
+{
+	pthread_once(&coro_stats_once, coro_stats_init_env);
+}
+
+void
+coro_stats_enable(bool is_enabled)
+{
+	coro_clock_init();
+	coro_stats_is_enabled = is_enabled;
+}
+
+/**
+ * Coroutine I/O. Descriptors which support readiness polling
+ * (pipes, sockets, ... opened with O_NONBLOCK) are waited for in
+ * the scheduler's epoll, and are in it only for the wait - the
+ * coroutine can go on on another thread. Regular files are always "ready" for
+ * epoll and are rejected by it, so the blocking calls on them, as
+ * well as on blocking descriptors and open(), are done by offload
+ * threads. The parked coroutine is then woken via the inbox of
+ * its scheduler and the eventfd in its epoll.
+ */
+enum coro_io_op {
+	CORO_IO_OPEN,
+	CORO_IO_READ,
+	CORO_IO_WRITE,
+};
+
+/** A blocking call to be done by an offload thread. */
+struct coro_io_job {
+	enum coro_io_op op;
+	int fd;
+	void *buf;
+	size_t size;
+	const char *path;
+	int flags;
+	mode_t mode;
+	/** Return value of the call and its errno. */
+	ssize_t result;
+	int error;
+	/** Who is waiting for the job. */
+	struct coro *coro;
+	struct coro_sched *sched;
+	struct coro_io_job *next;
+};
+
+static pthread_mutex_t coro_io_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t coro_io_cond = PTHREAD_COND_INITIALIZER;
+static struct coro_io_job *coro_io_head = NULL;
+static struct coro_io_job *coro_io_tail = NULL;
+static pthread_t coro_io_threads[CORO_IO_THREAD_COUNT];
+static bool coro_io_is_started = false;
+static bool coro_io_is_stopping = false;
+
+/** Create the event loop of the scheduler, if not yet. */
+static void
+coro_io_prepare(struct coro_sched *s)
+{
+	if (s->epfd >= 0)
+		return;
+	s->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (s->epfd < 0)
+		handle_error();
+	s->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (s->evfd < 0)
+		handle_error();
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->evfd, &ev) != 0)
+		handle_error();
+}
+
+/** Make the coroutines with completed offloaded I/O runnable. */
+static void
+coro_io_drain_inbox(struct coro_sched *s)
+{
+	pthread_mutex_lock(&s->io_lock);
+	struct coro *c = s->inbox_head;
+	__atomic_store_n(&s->inbox_head, NULL, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&s->io_lock);
+	coro_runq_lock(s);
+	while (c != NULL) {
+		struct coro *next = c->next;
+		coro_runq_push(s, c);
+		--s->io_wait_count;
+		c = next;
+	}
+	coro_runq_unlock(s);
+}
+
+/**
+ * epoll_wait(), but with @a timeout -1 not longer than until the
+ * nearest timer of the scheduler. epoll_pwait2() is used for that
+ * when the kernel has it - the timers are finer than milliseconds.
+ */
+static int
+coro_io_epoll_wait(struct coro_sched *s, struct epoll_event *events,
+		   int size, int timeout)
+{
+	if (timeout == 0 || s->timer_count == 0)
+		return epoll_wait(s->epfd, events, size, timeout);
+	uint64_t deadline = coro_timer_next(s) << coro_timer_shift;
+	uint64_t now = coro_clock();
+	uint64_t ns = deadline > now ?
+		      (uint64_t)((deadline - now) * 1000 / coro_ticks_per_us) :
+		      0;
+#ifdef SYS_epoll_pwait2
+	struct timespec ts;
+	ts.tv_sec = ns / 1000000000;
+	ts.tv_nsec = ns % 1000000000;
+	int rc = syscall(SYS_epoll_pwait2, s->epfd, events, size, &ts,
+			 NULL, 0);
+	if (rc >= 0 || errno != ENOSYS)
+		return rc;
+#endif
+	return epoll_wait(s->epfd, events, size, (ns + 999999) / 1000000);
+}
+
+/**
+ * Wait for I/O events at most @a timeout milliseconds, -1 means
+ * infinitely or until a timer, and make the woken coroutines
+ * runnable.
+ */
+static void
+coro_io_poll(struct coro_sched *s, int timeout)
+{
+	if (timeout != 0) {
+		__atomic_store_n(&s->is_polling, true, __ATOMIC_SEQ_CST);
+		/*
+		 * Pairs with coro_io_interrupt(): either a
+		 * concurrent push is seen here, or the pusher sees
+		 * the flag and writes the eventfd.
+		 */
+		coro_runq_lock(s);
+		if (s->runq_count > 0 ||
+		    __atomic_load_n(&s->inbox_head, __ATOMIC_SEQ_CST) != NULL)
+			timeout = 0;
+		coro_runq_unlock(s);
+	}
+	struct epoll_event events[64];
+	int count = coro_io_epoll_wait(s, events, 64, timeout);
+	__atomic_store_n(&s->is_polling, false, __ATOMIC_RELAXED);
+	if (count < 0 && errno != EINTR)
+		handle_error();
+	coro_runq_lock(s);
+	for (int i = 0; i < count; ++i) {
+		struct coro *c = events[i].data.ptr;
+		if (c == NULL) {
+			uint64_t value;
+			if (read(s->evfd, &value, sizeof(value)) < 0 &&
+			    errno != EAGAIN)
+				handle_error();
+			continue;
+		}
+		coro_runq_push(s, c);
+		--s->io_wait_count;
+	}
+	coro_runq_unlock(s);
+	coro_io_drain_inbox(s);
+	if (s->timer_count > 0)
+		coro_timer_run(s);
+}
+
+/** Park the current coroutine until @a fd is ready for @a events. */
+static void
+coro_io_wait_fd(struct coro_sched *s, int fd, uint32_t events)
+{
+	coro_io_prepare(s);
+	struct epoll_event ev;
+	ev.events = events | EPOLLONESHOT;
+	ev.data.ptr = s->this;
+	/*
+	 * Only this thread polls this epoll, so the event can not be
+	 * handled before the coroutine is parked.
+	 */
+	if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+		if (errno != EEXIST ||
+		    epoll_ctl(s->epfd, EPOLL_CTL_MOD, fd, &ev) != 0)
+			handle_error();
+	}
+	++s->io_wait_count;
+	coro_park(s, NULL, NULL);
+	/*
+	 * The coroutine can be stolen and wait on the epoll of another
+	 * thread next time. Nothing is left here to point at it. The
+	 * descriptor could be closed meanwhile, then it is gone from
+	 * the epoll already.
+	 */
+	if (epoll_ctl(s->epfd, EPOLL_CTL_DEL, fd, NULL) != 0 &&
+	    errno != EBADF && errno != ENOENT)
+		handle_error();
+}
+
+static void *
+coro_io_thread_f(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&coro_io_lock);
+	while (true) {
+		struct coro_io_job *job = coro_io_head;
+		if (job == NULL) {
+			if (coro_io_is_stopping)
+				break;
+			pthread_cond_wait(&coro_io_cond, &coro_io_lock);
+			continue;
+		}
+		coro_io_head = job->next;
+		if (coro_io_head == NULL)
+			coro_io_tail = NULL;
+		pthread_mutex_unlock(&coro_io_lock);
+
+		ssize_t rc = -1;
+		switch (job->op) {
+		case CORO_IO_OPEN:
+			rc = open(job->path, job->flags, job->mode);
+			break;
+		case CORO_IO_READ:
+			rc = read(job->fd, job->buf, job->size);
+			break;
+		case CORO_IO_WRITE:
+			rc = write(job->fd, job->buf, job->size);
+			break;
+		}
+		job->result = rc;
+		job->error = rc < 0 ? errno : 0;
+		/*
+		 * The job is owned by the coroutine. Once it is in
+		 * the inbox, it can run again at any moment.
+		 */
+		struct coro_sched *s = job->sched;
+		struct coro *c = job->coro;
+		pthread_mutex_lock(&s->io_lock);
+		c->next = s->inbox_head;
+		__atomic_store_n(&s->inbox_head, c, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&s->io_lock);
+		uint64_t one = 1;
+		if (write(s->evfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			handle_error();
+
+		pthread_mutex_lock(&coro_io_lock);
+	}
+	pthread_mutex_unlock(&coro_io_lock);
+	return NULL;
+}
+
+/** Queue the job. Called once its coroutine is switched out. */
+static void
+coro_io_submit(struct coro *c, void *arg)
+{
+	(void)c;
+	struct coro_io_job *job = arg;
+	pthread_mutex_lock(&coro_io_lock);
+	if (! coro_io_is_started) {
+		coro_io_is_started = true;
+		coro_io_is_stopping = false;
+		for (int i = 0; i < CORO_IO_THREAD_COUNT; ++i) {
+			errno = pthread_create(&coro_io_threads[i], NULL,
+					       coro_io_thread_f, NULL);
+			if (errno != 0)
+				handle_error();
+		}
+	}
+	job->next = NULL;
+	if (coro_io_tail != NULL)
+		coro_io_tail->next = job;
+	else
+		coro_io_head = job;
+	coro_io_tail = job;
+	pthread_cond_signal(&coro_io_cond);
+	pthread_mutex_unlock(&coro_io_lock);
+}
+
+/** Do the job in an offload thread, parking until it is done. */
+static ssize_t
+coro_io_offload(struct coro_sched *s, struct coro_io_job *job)
+{
+	coro_io_prepare(s);
+	job->coro = s->this;
+	job->sched = s;
+	++s->io_wait_count;
+	coro_park(s, coro_io_submit, job);
+	errno = job->error;
+	return job->result;
+}
+
+/**
+ * Offload for a small coroutine. Its frames can leave the shared
+ * stack while the job is done, so the job, the buffer and the
+ * path are copied to the heap.
+ */
+static ssize_t
+coro_io_offload_small(struct coro_sched *s, struct coro_io_job *job)
+{
+	size_t size = job->op == CORO_IO_OPEN ? strlen(job->path) + 1 :
+						job->size;
+	struct coro_io_job *copy = malloc(sizeof(*copy) + size);
+	if (copy == NULL)
+		handle_error();
+	*copy = *job;
+	char *data = (char *)(copy + 1);
+	if (job->op == CORO_IO_OPEN) {
+		memcpy(data, job->path, size);
+		copy->path = data;
+	} else {
+		if (job->op == CORO_IO_WRITE)
+			memcpy(data, job->buf, size);
+		copy->buf = data;
+	}
+	ssize_t rc = coro_io_offload(s, copy);
+	int error = errno;
+	if (job->op == CORO_IO_READ && rc > 0)
+		memcpy(job->buf, data, rc);
+	free(copy);
+	errno = error;
+	return rc;
+}
+
+static void
+coro_io_offload_stop(void)
+{
+	pthread_mutex_lock(&coro_io_lock);
+	bool is_started = coro_io_is_started;
+	coro_io_is_stopping = true;
+	coro_io_is_started = false;
+	pthread_cond_broadcast(&coro_io_cond);
+	pthread_mutex_unlock(&coro_io_lock);
+	if (! is_started)
+		return;
+	for (int i = 0; i < CORO_IO_THREAD_COUNT; ++i)
+		pthread_join(coro_io_threads[i], NULL);
+}
+
+/**
+ * Scheduler of the current coroutine, or NULL, if the I/O should
+ * just block - outside of coroutines.
+ */
+static struct coro_sched *
+coro_io_sched(void)
+{
+	struct coro_sched *s = coro_sched_self();
+	if (s == NULL || s->this == &s->loop)
+		return NULL;
+	return s;
+}
+
+/** Read or write with parking on the event loop or offloading. */
+static ssize_t
+coro_io_rw(enum coro_io_op op, int fd, void *buf, size_t size)
+{
+	struct coro_sched *s = coro_io_sched();
+	int flags = s != NULL ? fcntl(fd, F_GETFL) : 0;
+	if (s != NULL && flags >= 0 && (flags & O_NONBLOCK) != 0) {
+		uint32_t events = op == CORO_IO_READ ? EPOLLIN : EPOLLOUT;
+		while (true) {
+			ssize_t rc = op == CORO_IO_READ ?
+				     read(fd, buf, size) :
+				     write(fd, buf, size);
+			if (rc >= 0 || (errno != EAGAIN &&
+					errno != EWOULDBLOCK))
+				return rc;
+			coro_io_wait_fd(s, fd, events);
+			s = coro_sched_self();
+		}
+	}
+	if (s == NULL || flags < 0) {
+		return op == CORO_IO_READ ? read(fd, buf, size) :
+					    write(fd, buf, size);
+	}
+	struct coro_io_job job;
+	memset(&job, 0, sizeof(job));
+	job.op = op;
+	job.fd = fd;
+	job.buf = buf;
+	job.size = size;
+	if (s->this->home != NULL)
+		return coro_io_offload_small(s, &job);
+	return coro_io_offload(s, &job);
+}
+
+ssize_t
+coro_read(int fd, void *buf, size_t size)
+{
+	return coro_io_rw(CORO_IO_READ, fd, buf, size);
+}
+
+ssize_t
+coro_write(int fd, const void *buf, size_t size)
+{
+	return coro_io_rw(CORO_IO_WRITE, fd, (void *)buf, size);
+}
+
+int
+coro_open(const char *path, int flags, mode_t mode)
+{
+	struct coro_sched *s = coro_io_sched();
+	if (s == NULL)
+		return open(path, flags, mode);
+	struct coro_io_job job;
+	memset(&job, 0, sizeof(job));
+	job.op = CORO_IO_OPEN;
+	job.path = path;
+	job.flags = flags;
+	job.mode = mode;
+	if (s->this->home != NULL)
+		return coro_io_offload_small(s, &job);
+	return coro_io_offload(s, &job);
+}
+
+void
+coro_sleep_until(uint64_t deadline_us)
+{
+	coro_clock_init();
+	uint64_t deadline = coro_clock_base + coro_us_to_ticks(deadline_us);
+	struct coro_sched *s = coro_io_sched();
+	if (s == NULL) {
+		uint64_t now;
+		while ((now = coro_clock()) < deadline) {
+			uint64_t us = (deadline - now) / coro_ticks_per_us + 1;
+			usleep(us < 1000000 ? us : 999999);
+		}
+		return;
+	}
+	if (coro_clock() >= deadline)
+		return;
+	coro_io_prepare(s);
+	/* A wheel without timers does not follow the time. */
+	if (s->timer_count == 0)
+		s->timer_now = coro_clock() >> coro_timer_shift;
+	struct coro_timer *t = &s->this->timer;
+	/* Rounded up - never wake up early. */
+	t->expire = (deadline + ((uint64_t)1 << coro_timer_shift) - 1) >>
+		    coro_timer_shift;
+	t->coro = s->this;
+	coro_timer_place(s, t);
+	++s->timer_count;
+	coro_park(s, NULL, NULL);
+}
+
+void
+coro_sleep_us(uint64_t us)
+{
+	if (us == 0) {
+		coro_yield();
+		return;
+	}
+	coro_sleep_until(coro_time_us() + us);
+}
+
+void
+coro_set_quantum(struct coro *c, uint64_t us)
+{
+	coro_clock_init();
+	c->quantum = coro_us_to_ticks(us);
+	struct coro_sched *s = coro_sched_self();
+	if (s != NULL && s->this == c && c->quantum != 0)
+		s->quantum_end = coro_clock() + c->quantum;
+}
+
+void
+coro_set_latency_target(struct coro *c, uint64_t us, bool is_adaptive)
+{
+	coro_clock_init();
+	c->latency_target = coro_us_to_ticks(us);
+	c->is_quantum_adaptive = is_adaptive && c->latency_target != 0;
+	c->queued_at = coro_clock();
+	/* Its running time is counted from now on. */
+	struct coro_sched *s = coro_sched_self();
+	if (s != NULL && s->this == c && ! coro_stats_is_enabled)
+		s->slice_start = c->queued_at;
+	if (c->is_quantum_adaptive)
+		coro_latency_clamp(c, c->quantum != 0 ? c->quantum :
+				   c->latency_target);
+}
+
+bool
+coro_quantum_is_over(void)
+{
+	struct coro_sched *s = coro_sched_self();
+	if (s == NULL || s->this->quantum == 0)
+		return false;
+	return coro_clock() >= s->quantum_end;
+}
+
+/**
+ * Body of every coroutine. Runs the coroutine function and
+ * leaves to the scheduler for good.
+ */
+static void
+coro_main(struct coro *c)
+{
+	/* Complete the switch which has brought here. */
+	coro_sched_after_switch(coro_sched_self());
+	c->ret = c->func(c->func_arg);
+	c->is_finished = true;
+	/*
+	 * Can not return - 'ret' address is invalid already! The
+	 * coroutine is never scheduled again, the scheduler loop
+	 * puts it into the completion queue.
+	 */
+	struct coro_sched *s = coro_sched_self();
+	/* Its frames on the shared stack don't need saving anymore. */
+	if (c->home != NULL)
+		s->small_owner = NULL;
+	coro_switch(s, &s->loop, CORO_LEAVE_FINISH);
+	__builtin_unreachable();
+}
+
+#if CORO_SWITCH_ASM
+
+enum {
+	/** Size of the initial frame in pointers. */
+#if defined(__x86_64__)
+	CORO_CTX_FRAME_SLOTS = 8,
+#else
+	CORO_CTX_FRAME_SLOTS = 20,
+#endif
+};
+
+/**
+ * Lay out an initial frame at @a sp as if coro_ctx_switch() was
+ * called on it right before the return into coro_ctx_start(). No
+ * syscalls, no signals - just a few stores.
+ */
+static void
+coro_ctx_frame(struct coro *c, void **sp)
+{
+#if defined(__x86_64__)
+	/* Default MXCSR in the low half, x87 control word above. */
+	sp[0] = (void *)(((uintptr_t)0x037F << 32) | 0x1F80);
+	/* r15, r14, r13. */
+	sp[1] = sp[2] = sp[3] = NULL;
+	/* r12 - the entry point, rbx - its argument. */
+	sp[4] = (void *)coro_main;
+	sp[5] = c;
+	/* rbp, the return address. */
+	sp[6] = NULL;
+	sp[7] = (void *)coro_ctx_start;
+#else
+	memset(sp, 0, CORO_CTX_FRAME_SLOTS * sizeof(*sp));
+	/* x19 - the argument, x20 - the entry point. */
+	sp[0] = c;
+	sp[1] = (void *)coro_main;
+	/* x29 stays zero to terminate frame chains, x30 - lr. */
+	sp[11] = (void *)coro_ctx_start;
+#endif
+}
+
+static void
+coro_ctx_init(struct coro *c, void *stack, size_t stack_size)
+{
+	/*
+	 * On x86-64 the return address is at top - 8, so
+	 * coro_ctx_start() runs with a 16-byte aligned stack and its
+	 * call pushes a properly aligned frame for coro_main().
+	 */
+	uintptr_t top = ((uintptr_t)stack + stack_size) & ~(uintptr_t)15;
+	void **sp = (void **)top - CORO_CTX_FRAME_SLOTS;
+	coro_ctx_frame(c, sp);
+	c->ctx = sp;
+}
+
+/**
+ * Make the initial frame of a small coroutine - as a saved copy,
+ * ready to be loaded onto the shared stack of @a s.
+ */
+static void
+coro_ctx_init_small(struct coro *c, struct coro_sched *s)
 {
-	return coro_this_ptr;
+	size_t size = CORO_CTX_FRAME_SLOTS * sizeof(void *);
+	c->copy = malloc(size);
+	if (c->copy == NULL)
+		handle_error();
+	c->copy_size = size;
+	c->copy_capacity = size;
+	coro_ctx_frame(c, c->copy);
+	c->ctx = s->small_top - size;
 }
 
+#else /* ! CORO_SWITCH_ASM */
+
 /**
  * The core part of the coroutines creation - this signal handler
  * is run on a separate stack using sigaltstack. On an invokation
@@ -160,8 +2719,8 @@ static void
 coro_body(int signum)
 {
 	(void)signum;
-	struct coro *c = coro_this_ptr;
-	coro_this_ptr = NULL;
+	struct coro *c = coro_body_arg;
+	coro_body_arg = NULL;
 	/*
 	 * On an invokation jump back to the constructor right
 	 * after remembering the context.
@@ -172,38 +2731,27 @@ coro_body(int signum)
 	 * If the execution is here, then the coroutine should
 	 * finaly start work.
 	 */
-	coro_this_ptr = c;
-	c->ret = c->func(c->func_arg);
-	c->is_finished = true;
-	/* Can not return - 'ret' address is invalid already! */
-	if (! is_sched_waiting) {
-		printf("Critical error - no place to return!\n");
-		exit(-1);
-	}
-	siglongjmp(coro_sched.ctx, 1);
+	coro_main(c);
 }
 
-struct coro *
-coro_new(coro_f func, void *func_arg)
+/**
+ * The portable way to get onto a new stack - deliver a signal on
+ * it via sigaltstack. Costs about ten syscalls and temporarily
+ * takes over SIGUSR2, so it is used only when there is no
+ * assembly backend for the platform.
+ */
+static void
+coro_ctx_init(struct coro *c, void *stack, size_t stack_size)
 {
-	struct coro *c = (struct coro *) malloc(sizeof(*c));
-	c->ret = 0;
-	int stack_size = 1024 * 1024;
-	if (stack_size < SIGSTKSZ)
-		stack_size = SIGSTKSZ;
-	c->stack = malloc(stack_size);
-	c->func = func;
-	c->func_arg = func_arg;
-	c->is_finished = false;
-	c->switch_count = 0;
 	/*
 	 * SIGUSR2 is used. First of all, block new signals to be
 	 * able to set a new handler.
 	 */
+	pthread_mutex_lock(&coro_body_lock);
 	sigset_t news, olds, suss;
 	sigemptyset(&news);
 	sigaddset(&news, SIGUSR2);
-	if (sigprocmask(SIG_BLOCK, &news, &olds) != 0)
+	if (pthread_sigmask(SIG_BLOCK, &news, &olds) != 0)
 		handle_error();
 	/*
 	 * New handler should jump onto a new stack and remember
@@ -218,21 +2766,19 @@ coro_new(coro_f func, void *func_arg)
 		handle_error();
 	/* Create that new stack. */
 	stack_t oldst, newst;
-	newst.ss_sp = c->stack;
+	newst.ss_sp = stack;
 	newst.ss_size = stack_size;
 	newst.ss_flags = 0;
 	if (sigaltstack(&newst, &oldst) != 0)
 		handle_error();
 	/* Jump onto the stack and remember its position. */
-	struct coro *old_this = coro_this_ptr;
-	coro_this_ptr = c;
+	coro_body_arg = c;
 	sigemptyset(&suss);
 	if (sigsetjmp(start_point, 1) == 0) {
 		raise(SIGUSR2);
-		while (coro_this_ptr != NULL)
+		while (coro_body_arg != NULL)
 			sigsuspend(&suss);
 	}
-	coro_this_ptr = old_this;
 	/*
 	 * Return the old stack, unblock SIGUSR2. In other words,
 	 * rollback all global changes. The newly created stack
@@ -249,10 +2795,660 @@ coro_new(coro_f func, void *func_arg)
 		handle_error();
 	if (sigaction(SIGUSR2, &oldsa, NULL) != 0)
 		handle_error();
-	if (sigprocmask(SIG_SETMASK, &olds, NULL) != 0)
+	if (pthread_sigmask(SIG_SETMASK, &olds, NULL) != 0)
+		handle_error();
+	pthread_mutex_unlock(&coro_body_lock);
+}
+
+#endif /* ! CORO_SWITCH_ASM */
+
+struct coro *
+coro_new(coro_f func, void *func_arg)
+{
+	return coro_new_ex(func, func_arg, 0);
+}
+
+/** Fill a zeroed coroutine struct, without a stack yet. */
+static void
+coro_init(struct coro *c, coro_f func, void *func_arg, long id)
+{
+	c->func = func;
+	c->func_arg = func_arg;
+	c->id = id;
+	c->state_start = coro_stats_is_enabled ? coro_clock() : 0;
+}
+
+/** Allocate a coroutine, without a stack yet. */
+static struct coro *
+coro_alloc(coro_f func, void *func_arg)
+{
+	struct coro *c = (struct coro *) calloc(1, sizeof(*c));
+	if (c == NULL)
 		handle_error();
+	coro_init(c, func, func_arg,
+		  __atomic_add_fetch(&coro_id_seq, 1, __ATOMIC_RELAXED));
+	return c;
+}
+
+/** Hand a coroutine with a ready context to the scheduler. */
+static void
+coro_start(struct coro *c)
+{
+	__atomic_add_fetch(&coro_alive_count, 1, __ATOMIC_RELAXED);
+	coro_sched_push(c);
+}
 
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, size_t stack_size)
+{
+	struct coro *c = coro_alloc(func, func_arg);
+	if (stack_size == 0)
+		stack_size = CORO_STACK_DEFAULT_SIZE;
+	if (stack_size < SIGSTKSZ)
+		stack_size = SIGSTKSZ;
+	c->stack = coro_stack_new(&stack_size);
+	c->stack_size = stack_size;
+	coro_ctx_init(c, c->stack, stack_size);
 	/* Now scheduler can work with that coroutine. */
-	coro_list_add(c);
+	coro_start(c);
+	return c;
+}
+
+struct coro *
+coro_new_small(coro_f func, void *func_arg)
+{
+#if CORO_SWITCH_ASM
+	struct coro_sched *home = coro_sched_self();
+	if (home == NULL) {
+		unsigned i = __atomic_fetch_add(&coro_spawn_cursor, 1,
+						__ATOMIC_RELAXED);
+		home = &coro_scheds[i % coro_sched_count];
+	}
+	struct coro *c = coro_alloc(func, func_arg);
+	c->home = home;
+	coro_ctx_init_small(c, home);
+	coro_start(c);
+	return c;
+#else
+	return coro_new_ex(func, func_arg, CORO_SMALL_STACK_FALLBACK_SIZE);
+#endif
+}
+
+/**
+ * Put the initial frame of a batch coroutine onto its stack. With
+ * the assembly backend it is done right before the first switch
+ * to the coroutine, so the creation of a batch does not touch
+ * the stacks. It is a few stores, no syscalls.
+ */
+static void
+coro_batch_prepare(struct coro *c)
+{
+	coro_ctx_init(c, c->stack, c->stack_size);
+}
+
+/**
+ * Make the @a count coroutines runnable at once. They go to the
+ * current thread's queue, or, outside of workers, are split
+ * evenly between the workers - a lock of each queue is taken
+ * once.
+ */
+static void
+coro_sched_push_batch(struct coro *coros, size_t count)
+{
+	struct coro_sched *self = coro_sched_self();
+	int part_count = self != NULL ? 1 : coro_sched_count;
+	unsigned first = 0;
+	if (self == NULL) {
+		first = __atomic_fetch_add(&coro_spawn_cursor, part_count,
+					   __ATOMIC_RELAXED);
+	}
+	for (int i = 0; i < part_count; ++i) {
+		struct coro_sched *s = self;
+		if (s == NULL)
+			s = &coro_scheds[(first + i) % coro_sched_count];
+		size_t begin = count * i / part_count;
+		size_t end = count * (i + 1) / part_count;
+		if (begin == end)
+			continue;
+		coro_runq_lock(s);
+		for (size_t j = begin; j < end; ++j)
+			coro_runq_push(s, &coros[j]);
+		coro_runq_unlock(s);
+		if (coro_is_mt)
+			coro_io_interrupt(s);
+	}
+	if (coro_is_mt)
+		coro_idle_wakeup(true);
+}
+
+void
+coro_new_batch(coro_f func, void **func_args, size_t count,
+	       struct coro **out)
+{
+	coro_new_batch_ex(func, func_args, NULL, count, out);
+}
+
+void
+coro_new_batch_ex(coro_f func, void **func_args, const int *prios,
+		  size_t count, struct coro **out)
+{
+	if (count == 0)
+		return;
+	struct coro_batch *b = (struct coro_batch *)
+		calloc(1, sizeof(*b) + count * sizeof(struct coro));
+	if (b == NULL)
+		handle_error();
+	size_t stack_size = CORO_STACK_DEFAULT_SIZE;
+	coro_stack_class(&stack_size);
+	size_t stride = stack_size + coro_page_size;
+	b->ref_count = count;
+	b->map_size = count * stride;
+	b->map = mmap(NULL, b->map_size, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (b->map == MAP_FAILED)
+		handle_error();
+	/*
+	 * The guard pages are not adjacent, so it is an mprotect() per
+	 * coroutine. Done here in one pass, not on the first switches.
+	 */
+	for (size_t i = 0; i < count; ++i) {
+		if (mprotect(b->map + i * stride, coro_page_size,
+			     PROT_NONE) != 0)
+			handle_error();
+	}
+	long id = __atomic_fetch_add(&coro_id_seq, count, __ATOMIC_RELAXED);
+	for (size_t i = 0; i < count; ++i) {
+		struct coro *c = &b->coros[i];
+		coro_init(c, func, func_args != NULL ? func_args[i] : NULL,
+			  id + i + 1);
+		c->batch = b;
+		if (prios != NULL)
+			coro_set_priority(c, prios[i]);
+		c->stack = b->map + i * stride + coro_page_size;
+		c->stack_size = stack_size;
+#if ! CORO_SWITCH_ASM
+		coro_batch_prepare(c);
+#endif
+		if (out != NULL)
+			out[i] = c;
+	}
+	__atomic_add_fetch(&coro_alive_count, count, __ATOMIC_RELAXED);
+	coro_sched_push_batch(b->coros, count);
+}
+
+/**
+ * Synchronization primitives. A waiter is parked - it is in no
+ * run queue and costs nothing to the scheduler until a wakeup.
+ * Each primitive has a lock, taken only in the multi-threaded
+ * mode, which is released after the waiter is switched out.
+ */
+
+/** FIFO of the waiters. */
+struct coro_waitq {
+	struct coro_waiter *head;
+	struct coro_waiter *tail;
+};
+
+static inline void
+coro_lock(pthread_mutex_t *lock)
+{
+	if (coro_is_mt)
+		pthread_mutex_lock(lock);
+}
+
+static inline void
+coro_unlock(pthread_mutex_t *lock)
+{
+	if (coro_is_mt)
+		pthread_mutex_unlock(lock);
+}
+
+static void
+coro_unlock_cb(struct coro *c, void *lock)
+{
+	(void)c;
+	coro_unlock(lock);
+}
+
+static void
+coro_waitq_push(struct coro_waitq *q, struct coro_waiter *w)
+{
+	w->next = NULL;
+	if (q->tail != NULL)
+		q->tail->next = w;
+	else
+		q->head = w;
+	q->tail = w;
+}
+
+static struct coro_waiter *
+coro_waitq_pop(struct coro_waitq *q)
+{
+	struct coro_waiter *w = q->head;
+	if (w == NULL)
+		return NULL;
+	q->head = w->next;
+	if (q->head == NULL)
+		q->tail = NULL;
+	return w;
+}
+
+/**
+ * Wake up the waiter. The waiter memory can't be used afterwards
+ * - it belongs to a coroutine which can already run.
+ */
+static void
+coro_waiter_wakeup(struct coro_waiter *w, bool is_done)
+{
+	struct coro *c = w->coro;
+	w->is_done = is_done;
+	coro_sched_push(c);
+}
+
+/**
+ * Enqueue the current coroutine into @a q with the message @a msg
+ * and park it, releasing @a lock after the switch. Returns the
+ * waiter with the wakeup result. Waiting is possible only inside
+ * a coroutine.
+ */
+static struct coro_waiter *
+coro_wait(struct coro_waitq *q, void *msg, pthread_mutex_t *lock)
+{
+	struct coro_sched *s = coro_io_sched();
+	if (s == NULL) {
+		printf("Critical error - can't wait outside of a coroutine!\n");
+		exit(-1);
+	}
+	struct coro_waiter *w = &s->this->waiter;
+	w->coro = s->this;
+	w->msg = msg;
+	w->is_done = false;
+	coro_waitq_push(q, w);
+	coro_park(s, coro_unlock_cb, lock);
+	return w;
+}
+
+static void
+coro_join_loop(struct coro *c);
+
+int
+coro_join(struct coro *c, void **result)
+{
+	struct coro_sched *s = coro_io_sched();
+	if (s != NULL && s->this == c) {
+		printf("Critical error - a coroutine can't join itself!\n");
+		exit(-1);
+	}
+	coro_lock(&coro_done_lock);
+	if (c->is_joined) {
+		printf("Critical error - the coroutine is joined already!\n");
+		exit(-1);
+	}
+	c->is_joined = true;
+	if (c->is_done) {
+		coro_done_remove(c);
+		coro_unlock(&coro_done_lock);
+	} else if (s != NULL) {
+		/* Is pushed back by coro_done_push(). */
+		c->joiner = s->this;
+		coro_park(s, coro_unlock_cb, &coro_done_lock);
+	} else if (coro_is_mt) {
+		while (! c->is_done)
+			pthread_cond_wait(&coro_done_cond, &coro_done_lock);
+		pthread_mutex_unlock(&coro_done_lock);
+	} else {
+		coro_join_loop(c);
+	}
+	if (result != NULL)
+		*result = c->result;
+	return c->ret;
+}
+
+/**
+ * Run the scheduler of the single-threaded mode until @a c is
+ * done, like coro_sched_wait() does, but leaving the completion
+ * queue alone.
+ */
+static void
+coro_join_loop(struct coro *c)
+{
+	struct coro_sched *s = &coro_sched_main;
+	while (! c->is_done) {
+		coro_timer_check(s);
+		struct coro *to = coro_runq_pop(s);
+		if (to != NULL) {
+			coro_switch(s, to, CORO_LEAVE_NONE);
+		} else if (s->io_wait_count > 0 || s->timer_count > 0) {
+			coro_io_poll(s, -1);
+		} else {
+			printf("Critical error - the joined coroutine waits "
+			       "forever!\n");
+			exit(-1);
+		}
+	}
+}
+
+void
+coro_set_result(void *result)
+{
+	struct coro_sched *s = coro_io_sched();
+	if (s == NULL) {
+		printf("Critical error - no result outside of a coroutine!\n");
+		exit(-1);
+	}
+	s->this->result = result;
+}
+
+/** Keys of the coroutine-local storage, given out so far. */
+static int coro_local_key_count = 0;
+
+int
+coro_local_key_new(void)
+{
+	int key = __atomic_load_n(&coro_local_key_count, __ATOMIC_RELAXED);
+	do {
+		if (key >= CORO_LOCAL_SLOTS)
+			return -1;
+	} while (! __atomic_compare_exchange_n(&coro_local_key_count, &key,
+					       key + 1, false,
+					       __ATOMIC_RELAXED,
+					       __ATOMIC_RELAXED));
+	return key;
+}
+
+void *
+coro_local_get(int key)
+{
+	struct coro_sched *s = coro_io_sched();
+	return s != NULL ? s->this->local[key] : NULL;
+}
+
+void
+coro_local_set(int key, void *value)
+{
+	struct coro_sched *s = coro_io_sched();
+	if (s == NULL) {
+		printf("Critical error - no coroutine-local storage outside "
+		       "of a coroutine!\n");
+		exit(-1);
+	}
+	s->this->local[key] = value;
+}
+
+struct coro_mutex {
+	pthread_mutex_t lock;
+	bool is_locked;
+	struct coro_waitq waiters;
+};
+
+struct coro_mutex *
+coro_mutex_new(void)
+{
+	struct coro_mutex *m = calloc(1, sizeof(*m));
+	if (m == NULL)
+		handle_error();
+	pthread_mutex_init(&m->lock, NULL);
+	return m;
+}
+
+void
+coro_mutex_delete(struct coro_mutex *m)
+{
+	pthread_mutex_destroy(&m->lock);
+	free(m);
+}
+
+void
+coro_mutex_lock(struct coro_mutex *m)
+{
+	coro_lock(&m->lock);
+	if (! m->is_locked) {
+		m->is_locked = true;
+		coro_unlock(&m->lock);
+		return;
+	}
+	/* The unlocker hands the ownership over directly. */
+	coro_wait(&m->waiters, NULL, &m->lock);
+}
+
+bool
+coro_mutex_trylock(struct coro_mutex *m)
+{
+	coro_lock(&m->lock);
+	bool is_acquired = ! m->is_locked;
+	m->is_locked = true;
+	coro_unlock(&m->lock);
+	return is_acquired;
+}
+
+void
+coro_mutex_unlock(struct coro_mutex *m)
+{
+	coro_lock(&m->lock);
+	struct coro_waiter *w = coro_waitq_pop(&m->waiters);
+	if (w != NULL)
+		coro_waiter_wakeup(w, true);
+	else
+		m->is_locked = false;
+	coro_unlock(&m->lock);
+}
+
+struct coro_cond {
+	pthread_mutex_t lock;
+	struct coro_waitq waiters;
+};
+
+struct coro_cond *
+coro_cond_new(void)
+{
+	struct coro_cond *c = calloc(1, sizeof(*c));
+	if (c == NULL)
+		handle_error();
+	pthread_mutex_init(&c->lock, NULL);
 	return c;
 }
+
+void
+coro_cond_delete(struct coro_cond *c)
+{
+	pthread_mutex_destroy(&c->lock);
+	free(c);
+}
+
+void
+coro_cond_wait(struct coro_cond *c, struct coro_mutex *m)
+{
+	coro_lock(&c->lock);
+	/*
+	 * A signal can't come between the unlock and the parking -
+	 * it needs the condition lock, released after the switch.
+	 */
+	coro_mutex_unlock(m);
+	coro_wait(&c->waiters, NULL, &c->lock);
+	coro_mutex_lock(m);
+}
+
+void
+coro_cond_signal(struct coro_cond *c)
+{
+	coro_lock(&c->lock);
+	struct coro_waiter *w = coro_waitq_pop(&c->waiters);
+	if (w != NULL)
+		coro_waiter_wakeup(w, true);
+	coro_unlock(&c->lock);
+}
+
+void
+coro_cond_broadcast(struct coro_cond *c)
+{
+	coro_lock(&c->lock);
+	struct coro_waiter *w;
+	while ((w = coro_waitq_pop(&c->waiters)) != NULL)
+		coro_waiter_wakeup(w, true);
+	coro_unlock(&c->lock);
+}
+
+struct coro_wg {
+	pthread_mutex_t lock;
+	long count;
+	struct coro_waitq waiters;
+};
+
+struct coro_wg *
+coro_wg_new(void)
+{
+	struct coro_wg *wg = calloc(1, sizeof(*wg));
+	if (wg == NULL)
+		handle_error();
+	pthread_mutex_init(&wg->lock, NULL);
+	return wg;
+}
+
+void
+coro_wg_delete(struct coro_wg *wg)
+{
+	pthread_mutex_destroy(&wg->lock);
+	free(wg);
+}
+
+void
+coro_wg_add(struct coro_wg *wg, long delta)
+{
+	coro_lock(&wg->lock);
+	wg->count += delta;
+	if (wg->count <= 0) {
+		struct coro_waiter *w;
+		while ((w = coro_waitq_pop(&wg->waiters)) != NULL)
+			coro_waiter_wakeup(w, true);
+	}
+	coro_unlock(&wg->lock);
+}
+
+void
+coro_wg_done(struct coro_wg *wg)
+{
+	coro_wg_add(wg, -1);
+}
+
+void
+coro_wg_wait(struct coro_wg *wg)
+{
+	coro_lock(&wg->lock);
+	if (wg->count <= 0) {
+		coro_unlock(&wg->lock);
+		return;
+	}
+	coro_wait(&wg->waiters, NULL, &wg->lock);
+}
+
+struct coro_chan {
+	pthread_mutex_t lock;
+	/** Ring buffer of the messages. */
+	void **buf;
+	size_t capacity;
+	size_t head;
+	size_t count;
+	bool is_closed;
+	/** Senders wait for space, receivers - for messages. */
+	struct coro_waitq senders;
+	struct coro_waitq receivers;
+};
+
+struct coro_chan *
+coro_chan_new(size_t capacity)
+{
+	struct coro_chan *ch = calloc(1, sizeof(*ch));
+	if (ch == NULL)
+		handle_error();
+	if (capacity > 0) {
+		ch->buf = malloc(capacity * sizeof(*ch->buf));
+		if (ch->buf == NULL)
+			handle_error();
+	}
+	ch->capacity = capacity;
+	pthread_mutex_init(&ch->lock, NULL);
+	return ch;
+}
+
+void
+coro_chan_delete(struct coro_chan *ch)
+{
+	pthread_mutex_destroy(&ch->lock);
+	free(ch->buf);
+	free(ch);
+}
+
+int
+coro_chan_send(struct coro_chan *ch, void *msg)
+{
+	coro_lock(&ch->lock);
+	if (ch->is_closed) {
+		coro_unlock(&ch->lock);
+		return -1;
+	}
+	struct coro_waiter *r = coro_waitq_pop(&ch->receivers);
+	if (r != NULL) {
+		r->msg = msg;
+		coro_waiter_wakeup(r, true);
+		coro_unlock(&ch->lock);
+		return 0;
+	}
+	if (ch->count < ch->capacity) {
+		ch->buf[(ch->head + ch->count) % ch->capacity] = msg;
+		++ch->count;
+		coro_unlock(&ch->lock);
+		return 0;
+	}
+	struct coro_waiter *w = coro_wait(&ch->senders, msg, &ch->lock);
+	return w->is_done ? 0 : -1;
+}
+
+int
+coro_chan_recv(struct coro_chan *ch, void **msg)
+{
+	coro_lock(&ch->lock);
+	struct coro_waiter *s;
+	if (ch->count > 0) {
+		*msg = ch->buf[ch->head];
+		ch->head = (ch->head + 1) % ch->capacity;
+		--ch->count;
+		/* A space has appeared - take a blocked sender's message. */
+		s = coro_waitq_pop(&ch->senders);
+		if (s != NULL) {
+			ch->buf[(ch->head + ch->count) % ch->capacity] = s->msg;
+			++ch->count;
+			coro_waiter_wakeup(s, true);
+		}
+		coro_unlock(&ch->lock);
+		return 0;
+	}
+	s = coro_waitq_pop(&ch->senders);
+	if (s != NULL) {
+		*msg = s->msg;
+		coro_waiter_wakeup(s, true);
+		coro_unlock(&ch->lock);
+		return 0;
+	}
+	if (ch->is_closed) {
+		coro_unlock(&ch->lock);
+		return -1;
+	}
+	struct coro_waiter *w = coro_wait(&ch->receivers, NULL, &ch->lock);
+	if (! w->is_done)
+		return -1;
+	*msg = w->msg;
+	return 0;
+}
+
+void
+coro_chan_close(struct coro_chan *ch)
+{
+	coro_lock(&ch->lock);
+	ch->is_closed = true;
+	struct coro_waiter *w;
+	while ((w = coro_waitq_pop(&ch->receivers)) != NULL)
+		coro_waiter_wakeup(w, false);
+	while ((w = coro_waitq_pop(&ch->senders)) != NULL)
+		coro_waiter_wakeup(w, false);
+	coro_unlock(&ch->lock);
+}
@@ -1,25 +1,96 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
 
 struct coro;
+struct coro_mutex;
+struct coro_cond;
+struct coro_wg;
+struct coro_chan;
 typedef int (*coro_f)(void *);
 
+/**
+ * Which runnable coroutine a scheduler picks next. Each thread
+ * orders its own run queue, the policy is common for all of them.
+ */
+enum coro_policy {
+	/** First in, first out. The default. */
+	CORO_POLICY_RR,
+	/**
+	 * Strict priority: the most important runnable coroutine
+	 * goes first, the equal ones take turns. A yield does not
+	 * switch to less important coroutines.
+	 */
+	CORO_POLICY_PRIO,
+	/**
+	 * Fair share, like the Linux CFS: the coroutine with the
+	 * smallest virtual runtime goes first. Virtual runtime is
+	 * the CPU time, scaled by a weight of the priority - each
+	 * next priority gets about 10% less of a contended thread.
+	 * A yield keeps running the current coroutine, while it is
+	 * still the one with the smallest virtual runtime.
+	 */
+	CORO_POLICY_FAIR,
+};
+
+enum {
+	/** The most important priority. */
+	CORO_PRIO_MIN = -20,
+	/** The least important priority. */
+	CORO_PRIO_MAX = 19,
+};
+
 /** Make current context scheduler. */
 void
 coro_sched_init(void);
 
+/**
+ * Make current context scheduler, which runs coroutines on
+ * @a thread_count worker threads. Each worker has its own run
+ * queue, and idle workers steal coroutines from the busy ones, so
+ * a coroutine can continue on another thread after a yield. The
+ * current thread does not run coroutines, it only creates them
+ * and waits for their finish via coro_sched_wait(). Keep in mind
+ * that a thread-local variable, including errno, read by a
+ * coroutine before a yield and after it can belong to different
+ * threads.
+ */
+void
+coro_sched_init_threads(int thread_count);
+
+/**
+ * Stop the worker threads, if any, and free cached stacks. All
+ * the coroutines have to be finished and deleted.
+ */
+void
+coro_sched_destroy(void);
+
 /**
  * Block until any coroutine has finished. It is returned. NULl,
- * if no coroutines.
+ * if no coroutines. In the single-threaded mode NULL is also
+ * returned when all the remaining coroutines wait on
+ * synchronization primitives - nobody can wake them up.
  */
 struct coro *
 coro_sched_wait(void);
 
-/** Currently working coroutine. */
+/**
+ * Currently working coroutine. NULL outside of coroutines,
+ * including the scheduler loop in coro_sched_wait().
+ */
 struct coro *
 coro_this(void);
 
+/**
+ * Set the scheduling policy. Can be changed only while there are
+ * no coroutines. coro_sched_destroy() resets it to round-robin.
+ */
+void
+coro_sched_set_policy(enum coro_policy policy);
+
 /**
  * Create a new coroutine. It is not started, just added to the
  * scheduler.
@@ -27,10 +98,84 @@ coro_this(void);
 struct coro *
 coro_new(coro_f func, void *func_arg);
 
+/**
+ * Same as coro_new(), but with a stack of at least @a stack_size
+ * bytes. 0 means the default size, 1MB. Stacks are reserved
+ * lazily - only the touched pages take physical memory - and an
+ * overflow hits a guard page.
+ */
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, size_t stack_size);
+
+/**
+ * Create a small coroutine - for massive fan-out of mostly idle
+ * ones. Small coroutines of a thread share one 256KB stack: the
+ * live frames of a coroutine are copied off it when another small
+ * one needs the stack, and back when the coroutine is resumed. An
+ * idle one costs the struct and a copy of its frames, hundreds of
+ * bytes. A switch between two small coroutines costs the copying
+ * and goes through the scheduler loop.
+ *
+ * The price: pointers to the stack of a small coroutine must not
+ * be used by others while it is switched out - its frames are
+ * not in place then. libcoro's own waits are safe. A small
+ * coroutine stays on the thread which has created it, or on the
+ * one picked at creation in the multi-threaded mode. With the
+ * sigjmp backend it is a coroutine with a 32KB stack.
+ */
+struct coro *
+coro_new_small(coro_f func, void *func_arg);
+
+/**
+ * Create @a count coroutines running @a func, the i-th one with
+ * the argument @a func_args[i], or NULL if @a func_args is NULL.
+ * They are put into @a out, if it is not NULL. Cheaper than
+ * coro_new() in a loop: the coroutines are one allocation, their
+ * 1MB stacks are one mapping with guard pages in between, and they
+ * are queued at once. Still each guard page costs an mprotect()
+ * call here, O(@a count) syscalls at the creation - none on the
+ * switches. The memory is freed when the last coroutine of the
+ * batch is deleted.
+ */
+void
+coro_new_batch(coro_f func, void **func_args, size_t count,
+	       struct coro **out);
+
+/**
+ * Same as coro_new_batch(), but the i-th coroutine gets the
+ * priority @a prios[i], if @a prios is not NULL. They are queued
+ * by these priorities from the start, which coro_set_priority()
+ * after the creation would not do - and it would race with the
+ * workers already running them.
+ */
+void
+coro_new_batch_ex(coro_f func, void **func_args, const int *prios,
+		  size_t count, struct coro **out);
+
 /** Return status of the coroutine. */
 int
 coro_status(const struct coro *c);
 
+/** Pointer result of the coroutine, see coro_set_result(). */
+void *
+coro_result(const struct coro *c);
+
+/** Set the pointer result of the current coroutine. */
+void
+coro_set_result(void *result);
+
+/**
+ * Wait until @a c has finished and take it over - it won't be
+ * returned by coro_sched_wait(), the caller deletes it. Returns
+ * the status of @a c, and its pointer result in @a result, if it
+ * is not NULL. A coroutine calling it is parked. Outside of
+ * coroutines the thread runs the coroutines meanwhile in the
+ * single-threaded mode, and blocks in the multi-threaded one. A
+ * coroutine can be joined only once, and not by itself.
+ */
+int
+coro_join(struct coro *c, void **result);
+
 long long
 coro_switch_count(const struct coro *c);
 
@@ -38,10 +183,354 @@ coro_switch_count(const struct coro *c);
 bool
 coro_is_finished(const struct coro *c);
 
-/** Free coroutine stack and it itself. */
+/**
+ * Set priority of the coroutine, from CORO_PRIO_MIN, the most
+ * important, to CORO_PRIO_MAX. The default is 0. The values are
+ * clamped to the range. A queued coroutine keeps its place until
+ * it is queued again.
+ */
+void
+coro_set_priority(struct coro *c, int prio);
+
+int
+coro_priority(const struct coro *c);
+
+/**
+ * Virtual runtime of the coroutine in microseconds - the time it
+ * has run, scaled by its priority weight: 1:1 for the priority 0,
+ * slower for the more important ones. Grows under the fair share
+ * policy only, and starts not below the one of the least served
+ * coroutine in the run queue, when it gets there.
+ */
+uint64_t
+coro_vruntime_us(const struct coro *c);
+
+enum {
+	/** Coroutine-local storage slots of each coroutine. */
+	CORO_LOCAL_SLOTS = 4,
+};
+
+/**
+ * Take a key of the coroutine-local storage - a pointer slot in
+ * each coroutine, NULL initially. The storage is a part of the
+ * coroutine, it costs no allocations. Returns -1, when all the
+ * CORO_LOCAL_SLOTS keys are taken. Keys are never returned.
+ */
+int
+coro_local_key_new(void);
+
+/**
+ * Value of the slot @a key of the current coroutine. NULL outside
+ * of coroutines.
+ */
+void *
+coro_local_get(int key);
+
+/** Set the slot @a key of the current coroutine. */
+void
+coro_local_set(int key, void *value);
+
+/**
+ * Profiling of the coroutines. When enabled, each switch and each
+ * queueing costs a runtime clock read. With them off, the ones
+ * with a latency target still have their cpu_us, wait_us,
+ * max_latency_us and run_count - the target needs those clocks
+ * anyway.
+ */
+enum {
+	/**
+	 * Buckets of the run queue wait histogram. Bucket 0 counts
+	 * waits below 1us, bucket i - from 2^(i-1) to 2^i us, the
+	 * last one - everything longer.
+	 */
+	CORO_LATENCY_BUCKETS = 24,
+};
+
+struct coro_stats {
+	/** Time the coroutine was running. */
+	uint64_t cpu_us;
+	/** Time it was runnable, waiting in a run queue. */
+	uint64_t wait_us;
+	/** Time it was parked: sleeping, waiting for I/O or locks. */
+	uint64_t park_us;
+	/** The longest wait in a run queue - the switch latency. */
+	uint64_t max_latency_us;
+	/** Calls of coro_yield(), same as coro_switch_count(). */
+	long long yield_count;
+	/** How many times the coroutine was switched to. */
+	long long run_count;
+	/**
+	 * Runs after a wait in the run queue longer than the latency
+	 * target. Counted even when the statistics are off.
+	 */
+	long long latency_miss_count;
+	/** The current time slice limit, 0 if none. */
+	uint64_t quantum_us;
+};
+
+/**
+ * Turn the statistics collection on or off. It is better done
+ * before any coroutines are created, their times start from
+ * there. Setting the LIBCORO_STATS environment variable to a file
+ * path, or to "-" for stderr, turns them on at the scheduler init
+ * and makes coro_stats_dump() there by coro_sched_destroy(), or at
+ * exit without it. Only then the finished coroutines are kept for
+ * the dump, at most 65536 per scheduler.
+ */
+void
+coro_stats_enable(bool is_enabled);
+
+/** Get the statistics of a coroutine. */
+void
+coro_stats(const struct coro *c, struct coro_stats *stats);
+
+/**
+ * Get the histogram of run queue waits of all the coroutines,
+ * CORO_LATENCY_BUCKETS counters.
+ */
+void
+coro_latency_histogram(uint64_t *hist);
+
+/** Statistics of a thread, which runs coroutines. */
+struct coro_thread_stats {
+	/** Time it was running coroutines, not its scheduler loop. */
+	uint64_t busy_us;
+	/** How many times it has switched to a coroutine. */
+	long long run_count;
+	/** Coroutines it has stolen from the other threads. */
+	long long steal_count;
+};
+
+/**
+ * Number of threads running coroutines: the workers in the
+ * multi-threaded mode, 1 otherwise. 0 without a scheduler.
+ */
+int
+coro_sched_thread_count(void);
+
+/**
+ * Get the statistics of the @a thread-th thread. Only the time
+ * the statistics were enabled is counted, or, with them off, the
+ * coroutines with a latency target. They are gone after
+ * coro_sched_destroy().
+ */
+void
+coro_thread_stats(int thread, struct coro_thread_stats *stats);
+
+/**
+ * Write the statistics of the finished coroutines kept for the
+ * LIBCORO_STATS dump, of the threads and the latency histogram
+ * as JSON to @a path, "-" means stderr. Returns
+ * 0 on success, -1 on error with errno set.
+ */
+int
+coro_stats_dump(const char *path);
+
+/** Return coroutine stack into the pool and free the coroutine. */
 void
 coro_delete(struct coro *c);
 
-/** Switch to another not finished coroutine. */
+/**
+ * Name of the context switch backend libcoro was built with:
+ * "asm-x86_64", "asm-aarch64" or "sigjmp". The latter is the
+ * portable fallback, forced by defining LIBCORO_SWITCH_SIGJMP.
+ */
+const char *
+coro_switch_backend(void);
+
+/**
+ * Switch to another not finished coroutine, if there is one
+ * runnable on this thread. Otherwise continue the current one.
+ */
 void
 coro_yield(void);
+
+/**
+ * Time by the runtime clock, in microseconds since the first use
+ * of libcoro. The clock is a hardware counter where available
+ * (TSC, the AArch64 virtual counter), CLOCK_MONOTONIC otherwise.
+ */
+uint64_t
+coro_time_us(void);
+
+/**
+ * Park the current coroutine for at least @a us microseconds.
+ * Sleepers are kept in a timer wheel of their scheduler with 16us
+ * resolution and take no place in the run queue. 0 is a yield.
+ * Outside of coroutines the thread just sleeps.
+ */
+void
+coro_sleep_us(uint64_t us);
+
+/** Park the current coroutine until coro_time_us() is @a deadline_us. */
+void
+coro_sleep_until(uint64_t deadline_us);
+
+/**
+ * Limit time slices of @a c to @a us microseconds, 0 removes the
+ * limit. The slice starts each time the coroutine is switched to,
+ * or when it yields without anybody else to run. For the current
+ * coroutine it restarts right away.
+ */
+void
+coro_set_quantum(struct coro *c, uint64_t us);
+
+/**
+ * Set the longest wait of @a c in the run queue, @a us
+ * microseconds, 0 removes it. Longer waits are counted as misses,
+ * see struct coro_stats. With @a is_adaptive the time slices are
+ * adapted to it: after each wait the quantum is the target shared
+ * by the coroutines in the run queue, scaled down when the waits
+ * on the thread come near the target and back up when they have
+ * a margin, and half of the target, when nobody else is there to
+ * run. The quantum set by coro_set_quantum() is the first
+ * guess. Meant for all the competing coroutines of a thread - one
+ * with a fixed long quantum makes the others shrink to the
+ * minimum.
+ */
+void
+coro_set_latency_target(struct coro *c, uint64_t us, bool is_adaptive);
+
+/**
+ * Check if the current coroutine has used up its time slice. Is a
+ * couple of loads and a counter read, no syscalls, and is meant
+ * for hot loops:
+ *
+ *     if (coro_quantum_is_over())
+ *         coro_yield();
+ *
+ * Always false without a quantum or outside of coroutines.
+ */
+bool
+coro_quantum_is_over(void);
+
+/**
+ * read(), which parks the current coroutine instead of blocking
+ * the thread. A descriptor with O_NONBLOCK is waited for in the
+ * scheduler's event loop, the others (regular files in the first
+ * place) are read by an offload thread. Outside of coroutines it
+ * is a plain read().
+ */
+ssize_t
+coro_read(int fd, void *buf, size_t size);
+
+/** write(), which parks the current coroutine. See coro_read(). */
+ssize_t
+coro_write(int fd, const void *buf, size_t size);
+
+/**
+ * open(), done by an offload thread while the current coroutine
+ * is parked. Outside of coroutines it is a plain open().
+ */
+int
+coro_open(const char *path, int flags, mode_t mode);
+
+/**
+ * Synchronization primitives. A coroutine waiting on any of them
+ * is parked - it leaves the run queue until a wakeup and costs
+ * nothing to the scheduler meanwhile. They work in both the
+ * single- and multi-threaded modes. Waiting is allowed only
+ * inside coroutines, the other operations can be done anywhere.
+ */
+
+/** Create a mutex, not locked. */
+struct coro_mutex *
+coro_mutex_new(void);
+
+/** Delete a mutex. It should not be locked. */
+void
+coro_mutex_delete(struct coro_mutex *m);
+
+/** Lock, waiting for the owner to unlock it, if needed. */
+void
+coro_mutex_lock(struct coro_mutex *m);
+
+/** Lock, if it is not locked. Returns true on success. */
+bool
+coro_mutex_trylock(struct coro_mutex *m);
+
+/**
+ * Unlock. If there are waiters, the oldest one becomes the
+ * owner right away.
+ */
+void
+coro_mutex_unlock(struct coro_mutex *m);
+
+/** Create a condition variable. */
+struct coro_cond *
+coro_cond_new(void);
+
+/** Delete a condition variable. Nobody should wait on it. */
+void
+coro_cond_delete(struct coro_cond *c);
+
+/**
+ * Unlock @a m, wait for a signal, lock @a m back. Like with
+ * pthread, the condition should be checked again after a wakeup.
+ */
+void
+coro_cond_wait(struct coro_cond *c, struct coro_mutex *m);
+
+/** Wake up the oldest waiter, if any. */
+void
+coro_cond_signal(struct coro_cond *c);
+
+/** Wake up all the waiters. */
+void
+coro_cond_broadcast(struct coro_cond *c);
+
+/** Create a wait group, with the counter 0. */
+struct coro_wg *
+coro_wg_new(void);
+
+/** Delete a wait group. Nobody should wait on it. */
+void
+coro_wg_delete(struct coro_wg *wg);
+
+/**
+ * Add @a delta to the counter. When it drops to 0 or below, all
+ * the waiters are woken up.
+ */
+void
+coro_wg_add(struct coro_wg *wg, long delta);
+
+/** Same as coro_wg_add(wg, -1). */
+void
+coro_wg_done(struct coro_wg *wg);
+
+/** Wait until the counter is 0 or below. */
+void
+coro_wg_wait(struct coro_wg *wg);
+
+/**
+ * Create a channel of pointers, buffering up to @a capacity
+ * messages. With 0 capacity each send waits for a receiver.
+ */
+struct coro_chan *
+coro_chan_new(size_t capacity);
+
+/** Delete a channel. Nobody should wait on it. */
+void
+coro_chan_delete(struct coro_chan *ch);
+
+/**
+ * Send a message, waiting for a space in the buffer or a
+ * receiver. Returns 0 on success, -1 if the channel is closed.
+ */
+int
+coro_chan_send(struct coro_chan *ch, void *msg);
+
+/**
+ * Receive a message into @a msg, waiting for a sender if there is
+ * none. Returns 0 on success, -1 if the channel is closed and has
+ * no messages left.
+ */
+int
+coro_chan_recv(struct coro_chan *ch, void **msg);
+
+/**
+ * Close a channel. The waiting senders and receivers get -1, the
+ * buffered messages can still be received.
+ */
+void
+coro_chan_close(struct coro_chan *ch);
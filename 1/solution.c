@@ -4,33 +4,25 @@
 #include <time.h>
 #include <stdint.h>
 #include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
 #include "libcoro.h"
+#include "sort_algo.h"
+#include "sort_ext.h"
+#include "sort_io.h"
+#include "sort_merge.h"
 
 #define US_TO_MS(us) ((us / 1000))
 
-struct yield_context {
-    uint64_t work_time;
-    uint64_t last_yield_time;
-    uint64_t time_quantum;
-};
-
-struct File {
-    int *arr;
-    char *name;
-    int size;
-    struct yield_context *yield_ctx;
-};
+// Work time quantum that is allowed for each coroutine before switching
+static uint64_t time_quantum;
 
+// Latency from the arguments - the longest wait of a coroutine to run again
+static uint64_t target_latency;
 
-void write_to_file(const char *file_name, int *arr, int arr_size) {
-    FILE *file_p = fopen(file_name, "w");
-
-    for (int i = 0; i < arr_size; i++) {
-        fprintf(file_p, "%d ", arr[i]);
-    }
-
-    fclose(file_p);
-}
+// Whether the quanta follow the waits or stay fixed, set by -q
+static bool is_quantum_adaptive = true;
 
 static inline uint64_t get_monotonic_milliseconds(void) {
     struct timespec ts;
@@ -40,147 +32,318 @@ static inline uint64_t get_monotonic_milliseconds(void) {
     return ms;
 }
 
-static inline uint64_t get_monotonic_microseconds(void) {
-    struct timespec ts;
+// Memory for the sort of one file in the external mode, set by -m. 0 - the
+// files are sorted in memory
+static size_t file_memory;
 
-    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
-    uint64_t us = ((uint64_t) ts.tv_sec) * 1000000 + ((uint64_t) ts.tv_nsec) / 1000;
-    return us;
-}
+// Sort of the files, picked by -s
+static void (*sort_ints)(int *arr, int size) = simd_sort;
 
-static inline uint64_t last_yield_time_diff(uint64_t time, struct yield_context* yield_ctx) {
-    return time - yield_ctx->last_yield_time;
+// The quantum of the current coroutine is the first guess, an adaptive one
+// follows its waits from there
+static void setup_quantum(void) {
+    coro_set_quantum(coro_this(), time_quantum);
+    coro_set_latency_target(coro_this(), target_latency, is_quantum_adaptive);
 }
 
-void coro_update(uint64_t time, struct yield_context* yield_ctx) {
-    yield_ctx->work_time += last_yield_time_diff(time, yield_ctx);
-    yield_ctx->last_yield_time = get_monotonic_microseconds();
+// Starts a new time slice - of the quantum, adapted so far
+static void restart_quantum(void) {
+    struct coro_stats stats;
+    coro_stats(coro_this(), &stats);
+    coro_set_quantum(coro_this(), is_quantum_adaptive ? stats.quantum_us : time_quantum);
 }
 
-void swap(int *num1, int *num2) {
-    int tmp = *num1;
-    *num1 = *num2;
-    *num2 = tmp;
-}
+// Sorts the file in place, its sorted numbers stay in *file for the merge
+static void sort_file(struct File *file) {
+    // printf("%s: entered function\n", file->name);
 
-void quick_sort(int *arr, int low, int high, struct yield_context* yield_ctx) {
-    int mid = low + (high - low) / 2;
-    int pivot = arr[mid];
-    int i = low, j = high;
+    file_load(file);
 
-    while (i <= j) {
-        while (arr[i] < pivot) i++;
-        while (arr[j] > pivot) j--;
+    // Starting the quantum right before sorting - reading the file does not count
+    restart_quantum();
+    sort_ints(file->arr, file->size);
 
-        if (i <= j) {
-            swap(&arr[i], &arr[j]);
-            i++; j--;
-        }
+    file_store(file);
+}
 
-        uint64_t us_now = get_monotonic_microseconds();
 
-        // After exceeding allowed time quantum, yield and update coroutine information
-        if (yield_ctx->time_quantum <= last_yield_time_diff(us_now, yield_ctx)) {
-            coro_yield();
-            coro_update(us_now, yield_ctx);
-        }
+// Sorts the file in memory or by runs, by the mode
+static void sort_any_file(struct File *file) {
+    if (file_memory > 0) {
+        restart_quantum();
+        ext_sort_file(file->name, file_memory, sort_ints);
+    } else {
+        sort_file(file);
     }
-
-    if (low < j) quick_sort(arr, low, j, yield_ctx);
-    if (i < high) quick_sort(arr, i, high, yield_ctx);
 }
 
+static int coroutine_sort_f(void *context) {
+    struct coro *this = coro_this();
+    struct File *file = (struct File *) context;
 
-void merge_sort(struct File* _files, int num_arrays, int *result, int maxsize) {
-    int min, pos;
-    int *current_pos = calloc(num_arrays, sizeof(int));
+    setup_quantum();
+    sort_any_file(file);
 
-    for (int i = 0; i < maxsize; i++) {
-        min = INT32_MAX;
-        pos = -1;
+    struct coro_stats stats;
+    coro_stats(this, &stats);
+    uint64_t time_passed = stats.cpu_us;
+    printf("File %s: switch count %lld, work time: %llu ms (%llu microseconds), waited %llu us, "
+           "max latency %llu us, %lld misses, quantum %llu us\n", file->name,
+           (long long) coro_switch_count(this), (unsigned long long) US_TO_MS(time_passed), (unsigned long long) time_passed,
+           (unsigned long long) stats.wait_us, (unsigned long long) stats.max_latency_us, stats.latency_miss_count,
+           (unsigned long long) stats.quantum_us);
 
-        for(int j = 0; j < num_arrays; j++) {
-            if (current_pos[j] >= _files[j].size) continue;
-            if (_files[j].arr[current_pos[j]] < min) {
-                pos = j;
-                min = _files[j].arr[current_pos[j]];
-            }
-        }
+    return 0;
+}
+
+// A worker of the pool mode, sorts the files from the queue until it is empty
+struct worker {
+    int id;
+    struct coro_chan *queue;
+    int file_count;
+};
 
-        if (pos < 0) break;
+static int coroutine_worker_f(void *context) {
+    struct coro *this = coro_this();
+    struct worker *worker = (struct worker *) context;
+    void *msg;
 
-        current_pos[pos]++;
-        result[i] = min;
+    setup_quantum();
+    while (coro_chan_recv(worker->queue, &msg) == 0) {
+        sort_any_file((struct File *) msg);
+        worker->file_count++;
     }
-    free(current_pos);
-}
 
-static void sort_file(struct File *file) {
-    int count = 0, tmp, i = 0;
-    int *temp;
+    struct coro_stats stats;
+    coro_stats(this, &stats);
+    uint64_t time_passed = stats.cpu_us;
+    printf("Worker %d: %d files, switch count %lld, work time: %llu ms (%llu microseconds), waited %llu us, "
+           "max latency %llu us, %lld misses, quantum %llu us\n",
+           worker->id, worker->file_count, (long long) coro_switch_count(this),
+           (unsigned long long) US_TO_MS(time_passed), (unsigned long long) time_passed,
+           (unsigned long long) stats.wait_us, (unsigned long long) stats.max_latency_us, stats.latency_miss_count,
+           (unsigned long long) stats.quantum_us);
 
-    // printf("%s: entered function\n", file->name);
+    return 0;
+}
 
-    FILE *file_p = fopen(file->name, "r");
-    while(fscanf(file_p, "%d", &tmp) == 1) count++;
+static off_t file_size(const char *name) {
+    struct stat st;
+    return stat(name, &st) == 0 ? st.st_size : 0;
+}
 
-    file->size = count;
-    temp = (int *) realloc(file->arr, sizeof(int) * count);
-    if (temp == NULL) {
-        printf("Realloc failed: %s\n", strerror(errno));
-        free(file->arr);
+struct queued_file {
+    struct File *file;
+    off_t size;
+};
 
-        exit(EXIT_FAILURE);
-    } else {
-        file->arr = temp;
-    }
+// The largest first, the equal ones in the order of the arguments
+static int queued_file_cmp(const void *a, const void *b) {
+    const struct queued_file *qa = (const struct queued_file *) a;
+    const struct queued_file *qb = (const struct queued_file *) b;
+    if (qa->size != qb->size) return (qa->size < qb->size) - (qa->size > qb->size);
+    return (qa->file > qb->file) - (qa->file < qb->file);
+}
 
-    rewind(file_p);
+// The files, sorted by their sizes. Each one is stat()'ed once
+static struct queued_file *files_by_size(struct File *files, int file_count) {
+    struct queued_file *queued = (struct queued_file *) malloc(sizeof(struct queued_file) * file_count);
+    for (int i = 0; i < file_count; i++) {
+        queued[i].file = &files[i];
+        queued[i].size = file_size(files[i].name);
+    }
+    qsort(queued, file_count, sizeof(struct queued_file), queued_file_cmp);
+    return queued;
+}
 
-    while(i < count && (fscanf(file_p, "%d", &file->arr[i++]) == 1));
-    fclose(file_p);
+// The queue of the pool mode, the largest files go first - the small ones
+// left for the end even out the time the workers finish
+static struct coro_chan *file_queue_new(struct File *files, int file_count) {
+    struct queued_file *queued = files_by_size(files, file_count);
 
-    // Storing last yield time for current processed file right before performing quick sort for accurate results
-    file->yield_ctx->last_yield_time = get_monotonic_microseconds();
-    quick_sort(file->arr, 0, count - 1, file->yield_ctx);
+    // All the files fit, so nobody waits to send. Closed - the workers stop,
+    // when it is empty
+    struct coro_chan *queue = coro_chan_new(file_count);
+    for (int i = 0; i < file_count; i++) {
+        coro_chan_send(queue, queued[i].file);
+    }
+    coro_chan_close(queue);
+    free(queued);
+    return queue;
+}
 
-    // If file was processed with the time less than given quantum, it won't update
-    // coroutine information inside sorting algorithm, so we have to handle this case separately after sorting
-    if (coro_switch_count(coro_this()) == 0) {
-        coro_update(get_monotonic_microseconds(), file->yield_ctx);
+// ./a.out 6000 test1.txt test2.txt test3.txt test4.txt test5.txt test6.txt
+// 6 files, 6000 / 6 = 1000 us = 1 ms roughly given to one coroutine
+// so switch count in this case = work time in ms
+//
+// ./a.out -t 4 6000 test1.txt ... runs the coroutines on 4 threads. Each one
+// has its own scheduler over a part of the files, the idle ones steal from the
+// busy ones. The latency is per thread: 6 files on 2 threads get 6000 / 3 us
+//
+// ./a.out -p prio 6000 test1.txt ... picks the scheduling policy: rr (default),
+// prio - smaller files are more important and finish first, fair - CPU time is
+// shared equally between the coroutines
+//
+// ./a.out -s radix 6000 test1.txt ... picks the sort: simd (default, pdq
+// without AVX2), pdq or radix
+//
+// ./a.out -m 256 6000 test1.txt ... sorts files larger than the memory within
+// about 256 MB: by sorted runs in temporary files, merged back by streams
+//
+// ./a.out -c 4 6000 test1.txt ... sorts by a pool of 4 coroutines instead of
+// one per file: each takes the next file from a queue, the largest ones first.
+// The latency and the memory are shared by the workers then, not the files
+//
+// ./a.out -q fixed 6000 test1.txt ... keeps the quantum at the latency divided
+// by the coroutines of a thread. By default it is only the first guess: the
+// quanta follow how many coroutines are queued and how long they have waited
+// to run again, so they grow as the files are done, and shrink, when the
+// slices overshoot
+static int parse_policy(const char *name, enum coro_policy *policy) {
+    if (strcmp(name, "rr") == 0) {
+        *policy = CORO_POLICY_RR;
+    } else if (strcmp(name, "prio") == 0) {
+        *policy = CORO_POLICY_PRIO;
+    } else if (strcmp(name, "fair") == 0) {
+        *policy = CORO_POLICY_FAIR;
+    } else {
+        return -1;
     }
+    return 0;
+}
 
-    write_to_file(file->name, file->arr, count);
+static int parse_sort(const char *name) {
+    if (strcmp(name, "simd") == 0) {
+        sort_ints = simd_sort;
+    } else if (strcmp(name, "pdq") == 0) {
+        sort_ints = pdq_sort;
+    } else if (strcmp(name, "radix") == 0) {
+        sort_ints = radix_sort;
+    } else {
+        return -1;
+    }
+    return 0;
 }
 
+static void usage(const char *name) {
+    printf("Usage: %s [-t threads] [-c coroutines] [-p rr|prio|fair] [-s simd|pdq|radix] [-m memory_mb] "
+           "[-q adaptive|fixed] latency file...\n", name);
+    exit(EXIT_FAILURE);
+}
 
-static int coroutine_sort_f(void *context) {
-    struct coro *this = coro_this();
+// How the sorting has been spread over the threads. The busy time of all of
+// them to the time of the sort is how many of them have been sorting at once
+static void print_thread_stats(uint64_t sort_time) {
+    uint64_t busy_total = 0;
+
+    for (int i = 0; i < coro_sched_thread_count(); i++) {
+        struct coro_thread_stats stats;
+        coro_thread_stats(i, &stats);
+        busy_total += stats.busy_us;
+        printf("Thread %d: busy %llu ms (%llu microseconds), %lld runs, %lld steals\n", i,
+               (unsigned long long) US_TO_MS(stats.busy_us), (unsigned long long) stats.busy_us,
+               stats.run_count, stats.steal_count);
+    }
+    printf("Sorted in %llu ms, threads busy %llu ms, %.2f at once\n", (unsigned long long) sort_time,
+           (unsigned long long) US_TO_MS(busy_total), sort_time > 0 ? (double) busy_total / 1000 / sort_time : 0.0);
+}
 
-    struct File *file = (struct File *) context;
+// Latency of the sorting coroutines, summed up
+struct latency_report {
+    uint64_t max_us;
+    uint64_t wait_us;
+    long long run_count;
+    long long miss_count;
+};
 
-    sort_file(file);
+static void latency_report_add(struct latency_report *report, const struct coro *c) {
+    struct coro_stats stats;
+    coro_stats(c, &stats);
+    if (stats.max_latency_us > report->max_us) report->max_us = stats.max_latency_us;
+    report->wait_us += stats.wait_us;
+    report->run_count += stats.run_count;
+    report->miss_count += stats.latency_miss_count;
+}
 
-    uint64_t time_passed = file->yield_ctx->work_time;
-    printf("File %s: switch count %lld, work time: %llu ms (%llu microseconds)\n", file->name,
-           (long long) coro_switch_count(this), (unsigned long long) US_TO_MS(time_passed), (unsigned long long) time_passed);
+static void latency_report_print(const struct latency_report *report) {
+    printf("Latency: target %llu us, max %llu us, average %llu us, %lld of %lld runs missed, %s quanta\n",
+           (unsigned long long) target_latency, (unsigned long long) report->max_us,
+           (unsigned long long) (report->run_count > 0 ? report->wait_us / report->run_count : 0),
+           report->miss_count, report->run_count, is_quantum_adaptive ? "adaptive" : "fixed");
+}
 
-    return 0;
+// Priorities of the files by their sizes, the smallest one gets CORO_PRIO_MIN.
+// The ranks are spread evenly over all the levels, so with more files than
+// levels the neighbours share one
+static void file_priorities(struct File *files, int file_count, int *prios) {
+    struct queued_file *queued = files_by_size(files, file_count);
+    int levels = CORO_PRIO_MAX - CORO_PRIO_MIN + 1;
 
+    for (int i = 0; i < file_count; i++) {
+        // The smallest one is the last
+        long rank = file_count - 1 - i;
+        int prio = CORO_PRIO_MIN + (int) (rank * levels / file_count);
+        prios[queued[i].file - files] = prio;
+    }
+    free(queued);
 }
 
-// ./a.out 6000 test1.txt test2.txt test3.txt test4.txt test5.txt test6.txt
-// 6 files, 6000 / 6 = 1000 us = 1 ms roughly given to one coroutine
-// so switch count in this case = work time in ms
 int main(int argc, char **argv)
 {
-    coro_sched_init();
+    int thread_count = 0;
+    int worker_count = 0;
+    size_t memory = 0;
+    enum coro_policy policy = CORO_POLICY_RR;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "+t:c:p:s:m:q:")) != -1) {
+        switch (opt) {
+        case 't':
+            thread_count = atoi(optarg);
+            break;
+        case 'c':
+            worker_count = atoi(optarg);
+            if (worker_count <= 0) usage(argv[0]);
+            break;
+        case 'p':
+            if (parse_policy(optarg, &policy) != 0) usage(argv[0]);
+            break;
+        case 's':
+            if (parse_sort(optarg) != 0) usage(argv[0]);
+            break;
+        case 'q':
+            if (strcmp(optarg, "adaptive") == 0) {
+                is_quantum_adaptive = true;
+            } else if (strcmp(optarg, "fixed") == 0) {
+                is_quantum_adaptive = false;
+            } else {
+                usage(argv[0]);
+            }
+            break;
+        case 'm':
+            memory = (size_t) strtoul(optarg, NULL, 10) * 1024 * 1024;
+            if (memory == 0) usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind + 2 > argc) usage(argv[0]);
+
+    if (thread_count > 0) {
+        coro_sched_init_threads(thread_count);
+        printf("Threads: %d\n", thread_count);
+    } else {
+        coro_sched_init();
+    }
+    coro_sched_set_policy(policy);
 
-    const char *nptr = argv[1];
+    const char *nptr = argv[optind];
     char *endptr = NULL;
 
     errno = 0;
-    uint64_t target_latency = (uint64_t) strtoul(nptr, &endptr, 10);
+    target_latency = (uint64_t) strtoul(nptr, &endptr, 10);
 
     if ((nptr == endptr) || (target_latency == 0 && errno != 0) || errno == EINVAL) {
         printf("Conversion error\n");
@@ -191,53 +354,113 @@ int main(int argc, char **argv)
 
     printf("Target latency: %llu us\n", (unsigned long long) target_latency);
 
-    int file_count = argc - 2;
-    // Work time quantum that is allowed for each coroutine before switching
-    uint64_t time_quantum = target_latency / ((uint64_t) file_count);
+    int first_file = optind + 1;
+    int file_count = argc - first_file;
+    if (worker_count > file_count) worker_count = file_count;
+    // Coroutines, which sort at the same time: the files or the workers. Each
+    // thread switches between its share of them only, so the latency holds
+    // per thread
+    int coro_count = worker_count > 0 ? worker_count : file_count;
+    int sched_thread_count = thread_count > 0 ? thread_count : 1;
+    int coros_per_thread = (coro_count + sched_thread_count - 1) / sched_thread_count;
+    time_quantum = target_latency / ((uint64_t) coros_per_thread);
     printf("Allowed time quantum: %llu us\n", (unsigned long long) time_quantum);
+    // Each of them gets its share of the memory
+    file_memory = memory / coro_count;
 
     struct File* files = (struct File*) malloc(sizeof(struct File) * file_count);
+    struct coro **coros = (struct coro **) malloc(sizeof(struct coro *) * coro_count);
     uint64_t start_time = get_monotonic_milliseconds();
 
-    for (int i = 2; i < argc; i++) {
-        files[i - 2].name = strdup(argv[i]);
-        files[i - 2].arr = (int *) malloc(sizeof(int));
-        files[i - 2].size = 0;
-        files[i - 2].yield_ctx = (struct yield_context*) malloc(sizeof(struct yield_context));
-        files[i - 2].yield_ctx->time_quantum = time_quantum;
-        printf("Written time quantum: %llu us\n", (unsigned long long) files[i - 2].yield_ctx->time_quantum);
-
-        coro_new(coroutine_sort_f, (void *) &files[i - 2]);
+    for (int i = 0; i < file_count; i++) {
+        files[i].name = argv[first_file + i];
     }
 
-    struct coro *c;
-    while ((c = coro_sched_wait()) != NULL) {
-        printf("Finished %d\n", coro_status(c));
-        coro_delete(c);
+    void **args = (void **) malloc(sizeof(void *) * coro_count);
+    struct worker *workers = NULL;
+    struct coro_chan *queue = NULL;
+    if (worker_count > 0) {
+        queue = file_queue_new(files, file_count);
+        workers = (struct worker *) malloc(sizeof(struct worker) * worker_count);
+        for (int i = 0; i < worker_count; i++) {
+            workers[i] = (struct worker) {.id = i, .queue = queue};
+            args[i] = &workers[i];
+        }
+        coro_new_batch(coroutine_worker_f, args, worker_count, coros);
+    } else {
+        // One coroutine per file, all created at once
+        for (int i = 0; i < file_count; i++) {
+            args[i] = &files[i];
+        }
+        // The priorities are there before the coroutines are queued
+        int *prios = NULL;
+        if (policy == CORO_POLICY_PRIO) {
+            prios = (int *) malloc(sizeof(int) * file_count);
+            file_priorities(files, file_count, prios);
+        }
+        coro_new_batch_ex(coroutine_sort_f, args, prios, file_count, coros);
+        free(prios);
     }
-
-    int resulting_size = 0;
-    for (int i = 0; i < file_count; i++) {
-        resulting_size += files[i].size;
+    free(args);
+
+    // The coroutines are waited for in their order, the ones finished earlier
+    // just wait to be joined
+    struct latency_report latency = {0};
+    for (int i = 0; i < coro_count; i++) {
+        coro_join(coros[i], NULL);
+        latency_report_add(&latency, coros[i]);
+        if (worker_count > 0) {
+            printf("Finished worker %d\n", i);
+        } else {
+            printf("Finished %s\n", files[i].name);
+        }
+        coro_delete(coros[i]);
     }
-
-    int *result = calloc(resulting_size + 1, sizeof(int));
-
-    (void) merge_sort(files, (int) file_count, result, resulting_size);
-    write_to_file("result.txt", result, resulting_size);
+    if (queue != NULL) coro_chan_delete(queue);
+    free(workers);
+    uint64_t sort_time = get_monotonic_milliseconds() - start_time;
+    print_thread_stats(sort_time);
+    latency_report_print(&latency);
+    free(coros);
+
+    if (memory > 0) {
+        const char **names = (const char **) malloc(sizeof(char *) * file_count);
+        for (int i = 0; i < file_count; i++) {
+            names[i] = files[i].name;
+        }
+        ext_merge_files(names, file_count, "result.txt", memory);
+        free(names);
+    } else {
+        // The merge is split between the threads, each writes its own part of
+        // the result. The result is binary, when all the files are
+        const int **arrays = (const int **) malloc(sizeof(int *) * file_count);
+        int *sizes = (int *) malloc(sizeof(int) * file_count);
+        bool is_binary = true;
+        for (int i = 0; i < file_count; i++) {
+            arrays[i] = files[i].arr;
+            sizes[i] = files[i].size;
+            is_binary = is_binary && files[i].map != NULL;
+        }
+        merge_to_file(arrays, sizes, file_count, "result.txt", is_binary, thread_count > 0 ? thread_count : 1);
+        free(arrays);
+        free(sizes);
+    }
+    coro_sched_destroy();
 
     uint64_t end_time = get_monotonic_milliseconds();
 
     double total_time = (double) (end_time - start_time) / 1000;
     printf("Seconds passed %f (%llu ms)", total_time, (unsigned long long) (end_time - start_time));
 
-    for (int i = 0; i < file_count; i++) {
-        free(files[i].arr);
-        free(files[i].name);
-        free(files[i].yield_ctx);
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    printf("\nPeak RSS: %ld KB\n", ru.ru_maxrss);
+
+    // In the external mode the numbers are not kept
+    for (int i = 0; i < file_count && memory == 0; i++) {
+        file_release(&files[i]);
     }
 
     free(files);
-    free(result);
     return 0;
 }
@@ -0,0 +1,614 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libcoro.h"
+#include "sort_algo.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Ranges smaller than that are insertion sorted
+#define PDQ_INSERTION_SORT_THRESHOLD 24
+// Ranges larger than that get a pivot by the median of 3 medians of 3
+#define PDQ_NINTHER_THRESHOLD 128
+// Elements moved in total, after which a partial insertion sort gives up
+#define PDQ_PARTIAL_INSERTION_SORT_LIMIT 8
+// Elements compared by the block partitioning before any swaps, fits offsets
+// in unsigned char
+#define PDQ_BLOCK_SIZE 64
+
+// Numbers radix sort handles between two checks of the quantum
+#define RADIX_YIELD_BLOCK 4096
+
+// Sift-downs heap sort does between two checks of the quantum. Each one walks
+// the height of the heap, so there are fewer of them than radix sort's numbers
+#define HEAP_YIELD_BLOCK 1024
+
+// Numbers the SIMD sort handles between two checks of the quantum
+#define SIMD_YIELD_BLOCK 4096
+// The SIMD sort merges runs up to that size inside a chunk, so the first
+// passes stay in the L2 cache, and only then merges the chunks
+#define SIMD_CHUNK_SIZE (16 * 1024)
+
+// The quantum is tracked by the runtime, the check is a counter read
+static inline void sort_yield_point(void) {
+    if (coro_quantum_is_over()) {
+        coro_yield();
+    }
+}
+
+static inline void sort_swap(int *a, int *b) {
+    int tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+static inline void sort2(int *a, int *b) {
+    if (*b < *a) sort_swap(a, b);
+}
+
+static inline void sort3(int *a, int *b, int *c) {
+    sort2(a, b);
+    sort2(b, c);
+    sort2(a, b);
+}
+
+static void insertion_sort(int *begin, int *end) {
+    for (int *cur = begin + 1; cur < end; cur++) {
+        int *sift = cur;
+        int v = *cur;
+        while (sift != begin && v < sift[-1]) {
+            *sift = sift[-1];
+            sift--;
+        }
+        *sift = v;
+    }
+}
+
+// Same, but *(begin - 1) has to be not greater than any number in the range,
+// so it stops the sifts without a bound check
+static void unguarded_insertion_sort(int *begin, int *end) {
+    for (int *cur = begin + 1; cur < end; cur++) {
+        int *sift = cur;
+        int v = *cur;
+        while (v < sift[-1]) {
+            *sift = sift[-1];
+            sift--;
+        }
+        *sift = v;
+    }
+}
+
+// Insertion sort, which gives up after moving too many elements. Returns
+// whether the range got sorted
+static bool partial_insertion_sort(int *begin, int *end) {
+    int limit = 0;
+    for (int *cur = begin + 1; cur < end; cur++) {
+        int *sift = cur;
+        int v = *cur;
+        if (v < sift[-1]) {
+            do {
+                *sift = sift[-1];
+                sift--;
+            } while (sift != begin && v < sift[-1]);
+            *sift = v;
+            limit += cur - sift;
+        }
+        if (limit > PDQ_PARTIAL_INSERTION_SORT_LIMIT) return false;
+    }
+    return true;
+}
+
+static void sift_down(int *arr, int size, int root) {
+    int v = arr[root];
+    while (1) {
+        int child = 2 * root + 1;
+        if (child >= size) break;
+        if (child + 1 < size && arr[child] < arr[child + 1]) child++;
+        if (!(v < arr[child])) break;
+        arr[root] = arr[child];
+        root = child;
+    }
+    arr[root] = v;
+}
+
+static void heap_sort(int *begin, int *end) {
+    int size = end - begin;
+    for (int i = size / 2; i-- > 0;) {
+        sift_down(begin, size, i);
+        if ((i & (HEAP_YIELD_BLOCK - 1)) == 0) sort_yield_point();
+    }
+    for (int i = size - 1; i > 0; i--) {
+        sort_swap(&begin[0], &begin[i]);
+        sift_down(begin, i, 0);
+        if ((i & (HEAP_YIELD_BLOCK - 1)) == 0) sort_yield_point();
+    }
+}
+
+// Swaps num pairs of elements: left ones are at first + offsets_l[i], right
+// ones - at last - offsets_r[i]. When the counts differ, a cyclic permutation
+// does the same with fewer moves
+static inline void swap_offsets(int *first, int *last, const unsigned char *offsets_l,
+                                const unsigned char *offsets_r, int num, bool use_swaps) {
+    if (use_swaps) {
+        for (int i = 0; i < num; i++) {
+            sort_swap(first + offsets_l[i], last - offsets_r[i]);
+        }
+    } else if (num > 0) {
+        int *l = first + offsets_l[0];
+        int *r = last - offsets_r[0];
+        int tmp = *l;
+        *l = *r;
+        for (int i = 1; i < num; i++) {
+            l = first + offsets_l[i];
+            *r = *l;
+            r = last - offsets_r[i];
+            *l = *r;
+        }
+        *r = tmp;
+    }
+}
+
+// Partitions [begin, end) around the pivot *begin: the smaller numbers go left
+// of it, the rest - right. Returns the position of the pivot, and whether the
+// range already was partitioned. Blocks of elements are compared first, with
+// the positions of misplaced ones stored without branches, and swapped after
+static int *partition_right(int *begin, int *end, bool *is_partitioned) {
+    int pivot = *begin;
+    int *first = begin;
+    int *last = end;
+
+    // The pivot is a median, so there is a number not less than it to stop
+    // the first scan. The second one is bounded, if the first has not moved
+    while (*++first < pivot);
+    if (first - 1 == begin) {
+        while (first < last && !(*--last < pivot));
+    } else {
+        while (!(*--last < pivot));
+    }
+
+    *is_partitioned = first >= last;
+    if (!*is_partitioned) {
+        sort_swap(first, last);
+        first++;
+    }
+
+    unsigned char offsets_l[PDQ_BLOCK_SIZE];
+    unsigned char offsets_r[PDQ_BLOCK_SIZE];
+    int *offsets_l_base = first;
+    int *offsets_r_base = last;
+    int num_l = 0, num_r = 0, start_l = 0, start_r = 0;
+
+    while (first < last) {
+        // Fill the empty blocks. When both are empty and there is less than two
+        // blocks of unknown elements left, split them between the two
+        int num_unknown = last - first;
+        int left_split = num_l == 0 ? (num_r == 0 ? num_unknown / 2 : num_unknown) : 0;
+        int right_split = num_r == 0 ? num_unknown - left_split : 0;
+
+        if (left_split >= PDQ_BLOCK_SIZE) {
+            for (int i = 0; i < PDQ_BLOCK_SIZE; i++) {
+                offsets_l[num_l] = i;
+                num_l += !(*first < pivot);
+                first++;
+            }
+        } else {
+            for (int i = 0; i < left_split; i++) {
+                offsets_l[num_l] = i;
+                num_l += !(*first < pivot);
+                first++;
+            }
+        }
+
+        if (right_split >= PDQ_BLOCK_SIZE) {
+            for (int i = 1; i <= PDQ_BLOCK_SIZE; i++) {
+                offsets_r[num_r] = i;
+                last--;
+                num_r += *last < pivot;
+            }
+        } else {
+            for (int i = 1; i <= right_split; i++) {
+                offsets_r[num_r] = i;
+                last--;
+                num_r += *last < pivot;
+            }
+        }
+
+        int num = num_l < num_r ? num_l : num_r;
+        swap_offsets(offsets_l_base, offsets_r_base, offsets_l + start_l, offsets_r + start_r,
+                     num, num_l == num_r);
+        num_l -= num;
+        num_r -= num;
+        start_l += num;
+        start_r += num;
+        if (num_l == 0) {
+            start_l = 0;
+            offsets_l_base = first;
+        }
+        if (num_r == 0) {
+            start_r = 0;
+            offsets_r_base = last;
+        }
+
+        sort_yield_point();
+    }
+
+    // One of the blocks can have misplaced elements left, they are moved to
+    // the middle
+    if (num_l > 0) {
+        while (num_l-- > 0) {
+            last--;
+            sort_swap(offsets_l_base + offsets_l[start_l + num_l], last);
+        }
+        first = last;
+    }
+    if (num_r > 0) {
+        while (num_r-- > 0) {
+            sort_swap(offsets_r_base - offsets_r[start_r + num_r], first);
+            first++;
+        }
+        last = first;
+    }
+
+    int *pivot_pos = first - 1;
+    *begin = *pivot_pos;
+    *pivot_pos = pivot;
+    return pivot_pos;
+}
+
+// Partitions around the pivot *begin, with the numbers equal to it going
+// left. Used when the pivot equals the number before the range, so it is the
+// smallest one in the range and all the equal numbers are done with at once
+static int *partition_left(int *begin, int *end) {
+    int pivot = *begin;
+    int *first = begin;
+    int *last = end;
+    int steps = 0;
+
+    while (pivot < *--last);
+    if (last + 1 == end) {
+        while (first < last && !(pivot < *++first));
+    } else {
+        while (!(pivot < *++first));
+    }
+
+    while (first < last) {
+        sort_swap(first, last);
+        while (pivot < *--last);
+        while (!(pivot < *++first));
+        if ((++steps & (PDQ_BLOCK_SIZE - 1)) == 0) sort_yield_point();
+    }
+
+    int *pivot_pos = last;
+    *begin = *pivot_pos;
+    *pivot_pos = pivot;
+    return pivot_pos;
+}
+
+// Sorts [begin, end). bad_allowed is how many more unbalanced partitions are
+// let before heapsort. leftmost says there is nothing before begin, otherwise
+// *(begin - 1) is not greater than any number in the range
+static void pdq_loop(int *begin, int *end, int bad_allowed, bool leftmost) {
+    while (1) {
+        int size = end - begin;
+        if (size < PDQ_INSERTION_SORT_THRESHOLD) {
+            if (leftmost) {
+                insertion_sort(begin, end);
+            } else {
+                unguarded_insertion_sort(begin, end);
+            }
+            return;
+        }
+
+        // The pivot goes to *begin
+        int s2 = size / 2;
+        if (size > PDQ_NINTHER_THRESHOLD) {
+            sort3(begin, begin + s2, end - 1);
+            sort3(begin + 1, begin + (s2 - 1), end - 2);
+            sort3(begin + 2, begin + (s2 + 1), end - 3);
+            sort3(begin + (s2 - 1), begin + s2, begin + (s2 + 1));
+            sort_swap(begin, begin + s2);
+        } else {
+            sort3(begin + s2, begin, end - 1);
+        }
+
+        // Equal to the number before the range - the range has many equal ones
+        if (!leftmost && !(begin[-1] < *begin)) {
+            begin = partition_left(begin, end) + 1;
+            continue;
+        }
+
+        bool is_partitioned;
+        int *pivot_pos = partition_right(begin, end, &is_partitioned);
+        int l_size = pivot_pos - begin;
+        int r_size = end - (pivot_pos + 1);
+
+        if (l_size < size / 8 || r_size < size / 8) {
+            if (--bad_allowed == 0) {
+                heap_sort(begin, end);
+                return;
+            }
+
+            // Break the patterns, which could have made the pivot bad
+            if (l_size >= PDQ_INSERTION_SORT_THRESHOLD) {
+                sort_swap(begin, begin + l_size / 4);
+                sort_swap(pivot_pos - 1, pivot_pos - l_size / 4);
+                if (l_size > PDQ_NINTHER_THRESHOLD) {
+                    sort_swap(begin + 1, begin + (l_size / 4 + 1));
+                    sort_swap(begin + 2, begin + (l_size / 4 + 2));
+                    sort_swap(pivot_pos - 2, pivot_pos - (l_size / 4 + 1));
+                    sort_swap(pivot_pos - 3, pivot_pos - (l_size / 4 + 2));
+                }
+            }
+            if (r_size >= PDQ_INSERTION_SORT_THRESHOLD) {
+                sort_swap(pivot_pos + 1, pivot_pos + (1 + r_size / 4));
+                sort_swap(end - 1, end - r_size / 4);
+                if (r_size > PDQ_NINTHER_THRESHOLD) {
+                    sort_swap(pivot_pos + 2, pivot_pos + (2 + r_size / 4));
+                    sort_swap(pivot_pos + 3, pivot_pos + (3 + r_size / 4));
+                    sort_swap(end - 2, end - (1 + r_size / 4));
+                    sort_swap(end - 3, end - (2 + r_size / 4));
+                }
+            }
+        } else if (is_partitioned && partial_insertion_sort(begin, pivot_pos) &&
+                   partial_insertion_sort(pivot_pos + 1, end)) {
+            // A balanced partition without swaps - likely a sorted range
+            return;
+        }
+
+        // The smaller side is recursed into and the larger one is looped over,
+        // so the depth is at most log2(n) on the 1MB coroutine stack
+        if (l_size < r_size) {
+            pdq_loop(begin, pivot_pos, bad_allowed, leftmost);
+            begin = pivot_pos + 1;
+            leftmost = false;
+        } else {
+            pdq_loop(pivot_pos + 1, end, bad_allowed, false);
+            end = pivot_pos;
+        }
+    }
+}
+
+void pdq_sort(int *arr, int size) {
+    if (size < 2) return;
+    int log2 = 0;
+    while ((size >> log2) > 1) log2++;
+    pdq_loop(arr, arr + size, log2, true);
+}
+
+// Byte of the number, with the sign bit flipped, so negative numbers come first
+static inline unsigned radix_digit(int v, int pass) {
+    return (((uint32_t) v ^ 0x80000000u) >> (8 * pass)) & 0xff;
+}
+
+void radix_sort(int *arr, int size) {
+    if (size < 2) return;
+    if (size < PDQ_INSERTION_SORT_THRESHOLD) {
+        insertion_sort(arr, arr + size);
+        return;
+    }
+
+    // Counts of all the 4 passes in one read of the array
+    int counts[4][256];
+    memset(counts, 0, sizeof(counts));
+    for (int i = 0; i < size; i++) {
+        uint32_t v = (uint32_t) arr[i] ^ 0x80000000u;
+        counts[0][v & 0xff]++;
+        counts[1][(v >> 8) & 0xff]++;
+        counts[2][(v >> 16) & 0xff]++;
+        counts[3][v >> 24]++;
+        if ((i & (RADIX_YIELD_BLOCK - 1)) == 0) sort_yield_point();
+    }
+
+    int *buf = (int *) malloc(sizeof(int) * size);
+    int *from = arr, *to = buf;
+    for (int pass = 0; pass < 4; pass++) {
+        int *count = counts[pass];
+        if (count[radix_digit(arr[0], pass)] == size) continue;
+
+        int pos = 0;
+        for (int d = 0; d < 256; d++) {
+            int c = count[d];
+            count[d] = pos;
+            pos += c;
+        }
+        for (int begin = 0; begin < size; begin += RADIX_YIELD_BLOCK) {
+            int end = begin + RADIX_YIELD_BLOCK < size ? begin + RADIX_YIELD_BLOCK : size;
+            for (int i = begin; i < end; i++) {
+                int v = from[i];
+                to[count[radix_digit(v, pass)]++] = v;
+            }
+            sort_yield_point();
+        }
+
+        int *tmp = from;
+        from = to;
+        to = tmp;
+    }
+
+    if (from != arr) memcpy(arr, from, sizeof(int) * size);
+    free(buf);
+}
+
+#if defined(__x86_64__)
+
+#define AVX2 __attribute__((target("avx2")))
+
+// Compare-exchange of the columns: a gets the minimums, b - the maximums
+#define AVX2_COEX(a, b) do {                    \
+    __m256i coex_min = _mm256_min_epi32(a, b);  \
+    b = _mm256_max_epi32(a, b);                 \
+    a = coex_min;                               \
+} while (0)
+
+// Sorts 64 numbers into 8 sorted runs of 8: the optimal 19-comparator network
+// sorts the 8 columns of 8 rows, and a transpose turns the columns into rows
+static AVX2 void avx2_sort_block(int *block) {
+    __m256i r[8];
+    for (int i = 0; i < 8; i++) {
+        r[i] = _mm256_loadu_si256((const __m256i *) (block + 8 * i));
+    }
+
+    AVX2_COEX(r[0], r[2]); AVX2_COEX(r[1], r[3]); AVX2_COEX(r[4], r[6]); AVX2_COEX(r[5], r[7]);
+    AVX2_COEX(r[0], r[4]); AVX2_COEX(r[1], r[5]); AVX2_COEX(r[2], r[6]); AVX2_COEX(r[3], r[7]);
+    AVX2_COEX(r[0], r[1]); AVX2_COEX(r[2], r[3]); AVX2_COEX(r[4], r[5]); AVX2_COEX(r[6], r[7]);
+    AVX2_COEX(r[2], r[4]); AVX2_COEX(r[3], r[5]);
+    AVX2_COEX(r[1], r[4]); AVX2_COEX(r[3], r[6]);
+    AVX2_COEX(r[1], r[2]); AVX2_COEX(r[3], r[4]); AVX2_COEX(r[5], r[6]);
+
+    __m256i t[8], u[8];
+    for (int i = 0; i < 8; i += 2) {
+        t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+        t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+    }
+    for (int i = 0; i < 8; i += 4) {
+        u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+        u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+        u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+        u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+    }
+    for (int i = 0; i < 4; i++) {
+        r[i] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+        r[i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+    }
+
+    for (int i = 0; i < 8; i++) {
+        _mm256_storeu_si256((__m256i *) (block + 8 * i), r[i]);
+    }
+}
+
+// Sorts a bitonic register: compare-exchanges at the distances 4, 2 and 1
+static inline AVX2 __m256i avx2_bitonic_clean(__m256i v) {
+    __m256i p = _mm256_permute2x128_si256(v, v, 0x01);
+    v = _mm256_blend_epi32(_mm256_min_epi32(v, p), _mm256_max_epi32(v, p), 0xF0);
+    p = _mm256_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+    v = _mm256_blend_epi32(_mm256_min_epi32(v, p), _mm256_max_epi32(v, p), 0xCC);
+    p = _mm256_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1));
+    return _mm256_blend_epi32(_mm256_min_epi32(v, p), _mm256_max_epi32(v, p), 0xAA);
+}
+
+// Bitonic merge of two sorted registers: a gets the 8 smallest numbers of the
+// 16, b - the 8 largest, both sorted
+static inline AVX2 void avx2_merge_registers(__m256i *a, __m256i *b) {
+    __m256i reversed = _mm256_permutevar8x32_epi32(*b, _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+    __m256i low = _mm256_min_epi32(*a, reversed);
+    __m256i high = _mm256_max_epi32(*a, reversed);
+    *a = avx2_bitonic_clean(low);
+    *b = avx2_bitonic_clean(high);
+}
+
+// Merges the sorted runs a and b into out. While both have 8 numbers more, 8
+// are taken from the one with the smaller head and merged with the 8 largest
+// ones so far in registers. The rest is merged by scalar code
+static AVX2 void avx2_merge(const int *a, int a_size, const int *b, int b_size, int *out) {
+    const int *a_end = a + a_size;
+    const int *b_end = b + b_size;
+    int tail[8];
+    int tail_size = 0;
+
+    if (a_size >= 8 && b_size >= 8) {
+        __m256i low = _mm256_loadu_si256((const __m256i *) a);
+        __m256i high = _mm256_loadu_si256((const __m256i *) b);
+        a += 8;
+        b += 8;
+        int steps = 0;
+        while (1) {
+            avx2_merge_registers(&low, &high);
+            _mm256_storeu_si256((__m256i *) out, low);
+            out += 8;
+            if (a_end - a < 8 || b_end - b < 8) break;
+            // A select, not a branch - which run goes next is random
+            int is_a = *a <= *b;
+            low = _mm256_loadu_si256((const __m256i *) (is_a ? a : b));
+            a += 8 * is_a;
+            b += 8 * !is_a;
+            if ((++steps & (SIMD_YIELD_BLOCK / 8 - 1)) == 0) sort_yield_point();
+        }
+        _mm256_storeu_si256((__m256i *) tail, high);
+        tail_size = 8;
+    }
+
+    // Everything written is not greater than the tail and the rest of the runs
+    const int *t = tail;
+    const int *t_end = tail + tail_size;
+    while (t < t_end || a < a_end || b < b_end) {
+        int64_t tv = t < t_end ? *t : INT64_MAX;
+        int64_t av = a < a_end ? *a : INT64_MAX;
+        int64_t bv = b < b_end ? *b : INT64_MAX;
+        if (tv <= av && tv <= bv) {
+            *out++ = *t++;
+        } else if (av <= bv) {
+            *out++ = *a++;
+        } else {
+            *out++ = *b++;
+        }
+    }
+}
+
+// Merges the runs of width numbers of src pairwise into dst
+static AVX2 void avx2_merge_pass(const int *src, int *dst, int size, int width) {
+    for (int begin = 0; begin < size; begin += 2 * width) {
+        int mid = size - begin > width ? begin + width : size;
+        int end = size - mid > width ? mid + width : size;
+        if (mid == end) {
+            memcpy(dst + begin, src + begin, sizeof(int) * (end - begin));
+        } else {
+            avx2_merge(src + begin, mid - begin, src + mid, end - mid, dst + begin);
+        }
+    }
+}
+
+// Bottom-up merge sort over 8x8 sorted blocks. The chunks are sorted one by
+// one, then merged with each other
+static AVX2 void avx2_sort(int *arr, int size) {
+    int *buf = (int *) malloc(sizeof(int) * size);
+    int chunk_passes = 0;
+    for (int width = 8; width < SIMD_CHUNK_SIZE; width *= 2) {
+        chunk_passes++;
+    }
+
+    for (int chunk = 0; chunk < size; chunk += SIMD_CHUNK_SIZE) {
+        int len = size - chunk < SIMD_CHUNK_SIZE ? size - chunk : SIMD_CHUNK_SIZE;
+        int *from = arr + chunk, *to = buf + chunk;
+        int blocks_end = len / 64 * 64;
+        for (int i = 0; i < blocks_end; i += 64) {
+            avx2_sort_block(from + i);
+        }
+        insertion_sort(from + blocks_end, from + len);
+        sort_yield_point();
+
+        for (int width = 8; width < SIMD_CHUNK_SIZE; width *= 2) {
+            avx2_merge_pass(from, to, len, width);
+            int *tmp = from;
+            from = to;
+            to = tmp;
+            sort_yield_point();
+        }
+    }
+
+    int *from = chunk_passes % 2 == 0 ? arr : buf;
+    int *to = from == arr ? buf : arr;
+    for (long width = SIMD_CHUNK_SIZE; width < size; width *= 2) {
+        avx2_merge_pass(from, to, size, (int) width);
+        int *tmp = from;
+        from = to;
+        to = tmp;
+    }
+
+    if (from != arr) memcpy(arr, from, sizeof(int) * size);
+    free(buf);
+}
+
+#endif
+
+void simd_sort(int *arr, int size) {
+#if defined(__x86_64__)
+    if (size >= 64 && __builtin_cpu_supports("avx2")) {
+        avx2_sort(arr, size);
+        return;
+    }
+#endif
+    pdq_sort(arr, size);
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+// In-memory sorts of int arrays. Both yield inside a coroutine, when its time
+// quantum is over - every block of numbers or so, not only between recursion
+// levels, so a quantum is kept even while one large range is partitioned
+
+// Pattern-defeating quicksort: median of 3 or ninther pivots, block
+// partitioning without branches on comparisons, insertion sort for small
+// ranges and heapsort after too many unbalanced partitions. So it is
+// O(n log n) for any input, linear for sorted and mostly equal ones, and the
+// recursion depth is at most log2(n)
+void pdq_sort(int *arr, int size);
+
+// LSD radix sort by bytes, with a temporary buffer of the array's size. Passes
+// over a byte, which is the same in all the numbers, are skipped
+void radix_sort(int *arr, int size);
+
+// Merge sort with AVX2: sorting networks make sorted runs of 8 numbers, and
+// bitonic merges of registers merge the runs. The CPU is checked at runtime,
+// pdq_sort() is used without AVX2. Takes a temporary buffer of the array's size
+void simd_sort(int *arr, int size);
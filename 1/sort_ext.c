@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include "libcoro.h"
+#include "sort_ext.h"
+#include "sort_io.h"
+#include "sort_merge.h"
+
+// Read buffers are between these sizes, whatever the budget is. Smaller
+// reads would be dominated by syscalls, larger ones gain nothing
+#define EXT_MIN_BUFFER (64 * 1024)
+#define EXT_MAX_BUFFER (4 * 1024 * 1024)
+
+// The two buffers of an int_writer, they are not counted by the budget
+#define EXT_WRITER_MEMORY (2 * 1024 * 1024)
+
+// A reader takes up to 4 of its buffer sizes: the buffer being parsed, the
+// one being read ahead, and the parsed numbers of a text
+#define EXT_READER_BUFFERS 4
+
+// Numbers in a run at least, however small the budget is
+#define EXT_MIN_RUN (64 * 1024)
+
+// Merged numbers are handed to the writer by chunks
+#define EXT_CHUNK_SIZE 4096
+
+// Temporary files of the runs
+struct ext_runs {
+    char **names;
+    int count;
+    int capacity;
+    // The first ones are the files given to merge, they are not removed
+    int input_count;
+};
+
+static size_t ext_buffer_size(size_t memory) {
+    if (memory < EXT_MIN_BUFFER) return EXT_MIN_BUFFER;
+    if (memory > EXT_MAX_BUFFER) return EXT_MAX_BUFFER;
+    return memory;
+}
+
+static size_t ext_memory_left(size_t memory, size_t used) {
+    return memory > used ? memory - used : 0;
+}
+
+static char *ext_temp_file(void) {
+    const char *dir = getenv("TMPDIR");
+    if (dir == NULL || *dir == '\0') dir = "/tmp";
+
+    size_t len = strlen(dir) + sizeof("/sort_run_XXXXXX");
+    char *name = (char *) malloc(len);
+    snprintf(name, len, "%s/sort_run_XXXXXX", dir);
+    int fd = mkstemp(name);
+    if (fd < 0) {
+        printf("Can't create a temporary file in %s: %s\n", dir, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    return name;
+}
+
+static void ext_runs_add(struct ext_runs *runs, char *name) {
+    if (runs->count == runs->capacity) {
+        runs->capacity *= 2;
+        runs->names = (char **) realloc(runs->names, sizeof(char *) * runs->capacity);
+    }
+    runs->names[runs->count++] = name;
+}
+
+static void ext_runs_remove(struct ext_runs *runs, int begin, int end) {
+    for (int i = begin; i < end; i++) {
+        if (i >= runs->input_count) unlink(runs->names[i]);
+        free(runs->names[i]);
+        runs->names[i] = NULL;
+    }
+}
+
+// Sorts the run and spills it into a new temporary file
+static void ext_spill(struct ext_runs *runs, int *run, int size, void (*sort)(int *, int)) {
+    char *name = ext_temp_file();
+    sort(run, size);
+    write_to_file(name, run, size, true);
+    ext_runs_add(runs, name);
+}
+
+static int ext_refill(void *ctx, int index, const int **arr) {
+    struct int_reader **readers = (struct int_reader **) ctx;
+    return int_reader_next(readers[index], arr);
+}
+
+// Merges the sorted files into a new one by streams, their read buffers share
+// the memory
+static void ext_merge(const char *const *names, int count, const char *file_name, bool is_binary,
+                      size_t memory) {
+    size_t buffer_size = ext_buffer_size(ext_memory_left(memory, EXT_WRITER_MEMORY) /
+                                         (EXT_READER_BUFFERS * (size_t) count));
+    struct int_reader **readers = (struct int_reader **) malloc(sizeof(struct int_reader *) * count);
+    for (int i = 0; i < count; i++) {
+        readers[i] = int_reader_new(names[i], buffer_size);
+    }
+
+    struct merge_tree *tree = merge_tree_new_stream(ext_refill, readers, count);
+    struct int_writer *writer = int_writer_new(file_name, is_binary);
+    int *chunk = (int *) malloc(sizeof(int) * EXT_CHUNK_SIZE);
+    int len;
+    while ((len = merge_tree_next(tree, chunk, EXT_CHUNK_SIZE)) > 0) {
+        int_writer_put(writer, chunk, len);
+    }
+    int_writer_close(writer);
+    merge_tree_delete(tree);
+
+    for (int i = 0; i < count; i++) {
+        int_reader_delete(readers[i]);
+    }
+    free(readers);
+    free(chunk);
+}
+
+// Merges the runs into the file and removes them. Runs, which are too many
+// for the budget to read them all at once, are merged by groups into longer
+// runs first
+static void ext_merge_runs(struct ext_runs *runs, const char *file_name, bool is_binary, size_t memory) {
+    int fan_in = (int) (ext_memory_left(memory, EXT_WRITER_MEMORY) / (EXT_READER_BUFFERS * EXT_MIN_BUFFER));
+    if (fan_in < 2) fan_in = 2;
+
+    int first = 0;
+    while (runs->count - first > fan_in) {
+        char *name = ext_temp_file();
+        ext_merge((const char *const *) runs->names + first, fan_in, name, true, memory);
+        ext_runs_remove(runs, first, first + fan_in);
+        first += fan_in;
+        ext_runs_add(runs, name);
+    }
+    ext_merge((const char *const *) runs->names + first, runs->count - first, file_name, is_binary, memory);
+    ext_runs_remove(runs, first, runs->count);
+    free(runs->names);
+}
+
+void ext_sort_file(const char *file_name, size_t memory, void (*sort)(int *arr, int size)) {
+    // The read buffers take a small share, the rest is for the run and the
+    // buffer of the same size, the sort can take
+    size_t buffer_size = ext_buffer_size(memory / 16);
+    size_t run_memory = ext_memory_left(memory, EXT_READER_BUFFERS * buffer_size + EXT_WRITER_MEMORY);
+    size_t run_capacity = run_memory / (2 * sizeof(int));
+    if (run_capacity < EXT_MIN_RUN) run_capacity = EXT_MIN_RUN;
+    if (run_capacity > (size_t) INT32_MAX / 2) run_capacity = INT32_MAX / 2;
+
+    int *run = (int *) malloc(sizeof(int) * run_capacity);
+    int run_size = 0;
+    struct ext_runs runs = {.capacity = 16};
+    runs.names = (char **) malloc(sizeof(char *) * runs.capacity);
+
+    struct int_reader *reader = int_reader_new(file_name, buffer_size);
+    bool is_binary = int_reader_is_binary(reader);
+    const int *arr;
+    int count;
+    while ((count = int_reader_next(reader, &arr)) > 0) {
+        while (count > 0) {
+            int part = (int) run_capacity - run_size < count ? (int) run_capacity - run_size : count;
+            memcpy(run + run_size, arr, sizeof(int) * part);
+            run_size += part;
+            arr += part;
+            count -= part;
+            if (run_size == (int) run_capacity) {
+                ext_spill(&runs, run, run_size, sort);
+                run_size = 0;
+            }
+        }
+    }
+    int_reader_delete(reader);
+
+    // Fits into the memory - no runs
+    if (runs.count == 0) {
+        sort(run, run_size);
+        write_to_file(file_name, run, run_size, is_binary);
+        free(run);
+        free(runs.names);
+        return;
+    }
+
+    if (run_size > 0) ext_spill(&runs, run, run_size, sort);
+    free(run);
+    ext_merge_runs(&runs, file_name, is_binary, memory);
+}
+
+struct ext_merge_job {
+    const char *const *names;
+    int count;
+    const char *file_name;
+    size_t memory;
+};
+
+static int ext_merge_files_f(void *arg) {
+    struct ext_merge_job *job = (struct ext_merge_job *) arg;
+    struct ext_runs runs = {.count = job->count, .capacity = job->count + 1, .input_count = job->count};
+    runs.names = (char **) malloc(sizeof(char *) * runs.capacity);
+    bool is_binary = true;
+    for (int i = 0; i < job->count; i++) {
+        runs.names[i] = strdup(job->names[i]);
+        is_binary = is_binary && file_is_binary(job->names[i]);
+    }
+    ext_merge_runs(&runs, job->file_name, is_binary, job->memory);
+    return 0;
+}
+
+void ext_merge_files(const char *const *names, int count, const char *file_name, size_t memory) {
+    // The files are merged as the runs, by groups if they are too many. In a
+    // coroutine the readers read ahead
+    struct ext_merge_job job = {.names = names, .count = count, .file_name = file_name, .memory = memory};
+    struct coro *c = coro_new(ext_merge_files_f, &job);
+    coro_join(c, NULL);
+    coro_delete(c);
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stddef.h>
+
+// External sort of files, which do not fit into the memory. A file is read by
+// runs, which fit into the memory budget. Each run is sorted and spilled into a
+// temporary binary file, then the runs are merged back into the file by
+// streams. Temporary files go to $TMPDIR, /tmp by default
+
+// Sorts the file in its own format, taking about memory bytes
+void ext_sort_file(const char *file_name, size_t memory, void (*sort)(int *arr, int size));
+
+// Merges the sorted files into a new one by streams, taking about memory bytes.
+// The result is binary, when all the files are. Runs in a coroutine of the
+// scheduler, so it must be called outside of coroutines
+void ext_merge_files(const char *const *names, int count, const char *file_name, size_t memory);
@@ -0,0 +1,595 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "libcoro.h"
+#include "sort_io.h"
+
+#define IO_BUFFER_SIZE (64 * 1024)
+
+// Read buffers of a text, which is loaded whole
+#define TEXT_LOAD_BUFFER_SIZE (1024 * 1024)
+
+// Numbers parsed or formatted between two checks of the quantum
+#define TEXT_YIELD_BLOCK 4096
+
+// Zero bytes after the data of a read buffer, parse_int() reads past a number
+// by up to 16 bytes per digit run
+#define PARSE_PADDING 64
+
+// Formatting and parsing of a large buffer take milliseconds, the others should
+// not wait for them. Outside of coroutines and without a quantum it is no-op
+static inline void text_yield_point(void) {
+    if (coro_quantum_is_over()) {
+        coro_yield();
+    }
+}
+
+// File I/O goes through libcoro: inside a coroutine it parks only the coroutine
+// and the others keep sorting, outside of coroutines it is plain blocking I/O
+static void write_all(int fd, const char *buf, size_t size, const char *file_name) {
+    while (size > 0) {
+        ssize_t rc = coro_write(fd, buf, size);
+        if (rc < 0) {
+            printf("Write to %s failed: %s\n", file_name, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        buf += rc;
+        size -= (size_t) rc;
+    }
+}
+
+static int open_file(const char *file_name, int flags) {
+    int fd = coro_open(file_name, flags, 0644);
+    if (fd < 0) {
+        printf("Can't open %s: %s\n", file_name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+static const uint64_t powers_of_10[] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000,
+};
+
+// "00" to "99", two digits are formatted per division
+static const char digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static inline int digit_count(uint32_t v) {
+    // log10 by the bit length: 1233 / 4096 ~ log10(2)
+    int t = ((32 - __builtin_clz(v | 1)) * 1233) >> 12;
+    return t - ((v | 1) < powers_of_10[t]) + 1;
+}
+
+// Formats the value at p, returns the end. The length is known up front, the
+// digits are written from the end, two at a time
+static inline char *format_int(char *p, int value) {
+    uint32_t v = (uint32_t) value;
+    if (value < 0) {
+        *p++ = '-';
+        v = 0u - v;
+    }
+
+    char *end = p + digit_count(v), *q = end;
+
+    while (v >= 100) {
+        uint32_t pair = v % 100;
+        v /= 100;
+        q -= 2;
+        memcpy(q, digit_pairs + 2 * pair, 2);
+    }
+    if (v >= 10) {
+        memcpy(q - 2, digit_pairs + 2 * v, 2);
+    } else {
+        q[-1] = (char) ('0' + v);
+    }
+    return end;
+}
+
+#define WRITE_BUFFER_SIZE (1024 * 1024)
+
+struct write_buffer {
+    char *data;
+    size_t len;
+};
+
+struct int_writer {
+    int fd;
+    const char *name;
+    bool is_binary;
+    // Buffer being filled
+    struct write_buffer *cur;
+    struct write_buffer buffers[2];
+    // Filled buffers go to the writer coroutine, written ones come back. NULL
+    // outside of coroutines, the buffers are written right away then
+    struct coro_chan *full;
+    struct coro_chan *empty;
+    struct coro *coro;
+};
+
+static int int_writer_f(void *arg) {
+    struct int_writer *w = (struct int_writer *) arg;
+    void *msg;
+
+    while (coro_chan_recv(w->full, &msg) == 0) {
+        struct write_buffer *buf = (struct write_buffer *) msg;
+        write_all(w->fd, buf->data, buf->len, w->name);
+        buf->len = 0;
+        coro_chan_send(w->empty, buf);
+    }
+    return 0;
+}
+
+static struct int_writer *int_writer_create(int fd, const char *file_name, bool is_binary) {
+    struct int_writer *w = (struct int_writer *) calloc(1, sizeof(*w));
+    w->fd = fd;
+    w->name = file_name;
+    w->is_binary = is_binary;
+    w->buffers[0].data = (char *) malloc(WRITE_BUFFER_SIZE);
+    w->cur = &w->buffers[0];
+
+    if (coro_this() != NULL) {
+        w->buffers[1].data = (char *) malloc(WRITE_BUFFER_SIZE);
+        w->full = coro_chan_new(1);
+        w->empty = coro_chan_new(2);
+        coro_chan_send(w->empty, &w->buffers[1]);
+        w->coro = coro_new_ex(int_writer_f, w, 64 * 1024);
+    }
+    return w;
+}
+
+struct int_writer *int_writer_new(const char *file_name, bool is_binary) {
+    int fd = open_file(file_name, O_WRONLY | O_CREAT | O_TRUNC);
+    struct int_writer *w = int_writer_create(fd, file_name, is_binary);
+
+    if (is_binary) {
+        memcpy(w->cur->data, BINARY_MAGIC, BINARY_MAGIC_SIZE);
+        w->cur->len = BINARY_MAGIC_SIZE;
+    }
+    return w;
+}
+
+struct int_writer *int_writer_new_at(const char *file_name, bool is_binary, off_t offset) {
+    int fd = open_file(file_name, O_WRONLY | O_CREAT);
+    if (lseek(fd, offset, SEEK_SET) < 0) {
+        printf("Seek in %s failed: %s\n", file_name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return int_writer_create(fd, file_name, is_binary);
+}
+
+size_t int_text_size(const int *arr, int count) {
+    size_t size = 0;
+    for (int i = 0; i < count; i++) {
+        uint32_t v = arr[i] < 0 ? 0u - (uint32_t) arr[i] : (uint32_t) arr[i];
+        // Digits, the minus and the separator
+        size += digit_count(v) + (arr[i] < 0) + 1;
+    }
+    return size;
+}
+
+// Hands the current buffer over to the writer coroutine and takes a written
+// one, or writes it right away
+static void int_writer_flush(struct int_writer *w) {
+    if (w->coro == NULL) {
+        write_all(w->fd, w->cur->data, w->cur->len, w->name);
+        w->cur->len = 0;
+        return;
+    }
+
+    void *msg;
+    coro_chan_send(w->full, w->cur);
+    coro_chan_recv(w->empty, &msg);
+    w->cur = (struct write_buffer *) msg;
+}
+
+void int_writer_put(struct int_writer *w, const int *arr, int count) {
+    if (w->is_binary) {
+        const char *data = (const char *) arr;
+        size_t size = sizeof(int) * count;
+        while (size > 0) {
+            if (w->cur->len == WRITE_BUFFER_SIZE) int_writer_flush(w);
+            size_t part = WRITE_BUFFER_SIZE - w->cur->len;
+            if (part > size) part = size;
+            memcpy(w->cur->data + w->cur->len, data, part);
+            w->cur->len += part;
+            data += part;
+            size -= part;
+        }
+        return;
+    }
+
+    char *pos = w->cur->data + w->cur->len;
+    for (int i = 0; i < count; i++) {
+        // Longest int with a separator is 12 chars
+        if (w->cur->data + WRITE_BUFFER_SIZE - pos < 16) {
+            w->cur->len = pos - w->cur->data;
+            int_writer_flush(w);
+            pos = w->cur->data + w->cur->len;
+        }
+        pos = format_int(pos, arr[i]);
+        *pos++ = ' ';
+        if ((i + 1) % TEXT_YIELD_BLOCK == 0) text_yield_point();
+    }
+    w->cur->len = pos - w->cur->data;
+}
+
+void int_writer_close(struct int_writer *w) {
+    if (w->cur->len > 0) int_writer_flush(w);
+
+    if (w->coro != NULL) {
+        coro_chan_close(w->full);
+        coro_join(w->coro, NULL);
+        coro_delete(w->coro);
+        coro_chan_delete(w->full);
+        coro_chan_delete(w->empty);
+        free(w->buffers[1].data);
+    }
+
+    close(w->fd);
+    free(w->buffers[0].data);
+    free(w);
+}
+
+void write_to_file(const char *file_name, const int *arr, int arr_size, bool is_binary) {
+    struct int_writer *w = int_writer_new(file_name, is_binary);
+    int_writer_put(w, arr, arr_size);
+    int_writer_close(w);
+}
+
+static inline bool is_space(char c) {
+    return c == ' ' || (unsigned char) (c - '\t') <= '\r' - '\t';
+}
+
+// Length of the run of digits at p, up to 16. Reads 16 bytes
+static inline int digit_run(const char *p) {
+#if defined(__SSE2__)
+    __m128i bytes = _mm_loadu_si128((const __m128i *) p);
+    __m128i shifted = _mm_sub_epi8(bytes, _mm_set1_epi8('0'));
+    // Digits are the bytes which are 0..9 after the shift, unsigned
+    __m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(shifted, _mm_set1_epi8(9)), shifted);
+    unsigned mask = (unsigned) _mm_movemask_epi8(is_digit);
+    return __builtin_ctz(~mask);
+#else
+    int n = 0;
+    while (n < 16 && (unsigned char) (p[n] - '0') <= 9) n++;
+    return n;
+#endif
+}
+
+// Value of 1 to 8 digits at p. All 8 bytes are loaded at once, the digits are
+// combined pairwise by 3 multiplications. Bytes after the digits are shifted
+// out, and zeros come in front of them instead - leading zeros
+static inline uint64_t parse_digits(const char *p, int n) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    v -= 0x3030303030303030ULL;
+    v <<= 8 * (8 - n);
+    v = (v * 10) + (v >> 8);
+    v = (((v & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))) +
+         (((v >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+    return v;
+}
+
+// Parses the number after whitespace at pos into *value. Returns the position
+// after the number, or NULL when the text ends before end or goes on with
+// something, which is not a number
+static inline const char *parse_int(const char *pos, const char *end, int *value) {
+    while (is_space(*pos)) pos++;
+    if (pos >= end) return NULL;
+
+    bool is_negative = *pos == '-';
+    if (is_negative || *pos == '+') pos++;
+
+    // Like fscanf("%d"), stop on anything, which is not a number
+    int n = digit_run(pos);
+    if (n == 0) return NULL;
+
+    uint64_t v;
+    if (n <= 8) {
+        v = parse_digits(pos, n);
+    } else {
+        v = parse_digits(pos, 8) * powers_of_10[n - 8 < 8 ? n - 8 : 8] + parse_digits(pos + 8, n - 8 < 8 ? n - 8 : 8);
+        // Way out of the int range, the digits are only skipped
+        while (n == 16 && (n = digit_run(pos += 16)) > 0) {}
+    }
+
+    *value = (int) (is_negative ? -v : v);
+    return pos + n;
+}
+
+// Reads the first bytes of the file, returns whether they are the binary magic
+static bool read_magic(int fd) {
+    char magic[BINARY_MAGIC_SIZE];
+    ssize_t len = 0, rc;
+
+    while (len < BINARY_MAGIC_SIZE && (rc = coro_read(fd, magic + len, BINARY_MAGIC_SIZE - len)) > 0) {
+        len += rc;
+    }
+    return len == BINARY_MAGIC_SIZE && memcmp(magic, BINARY_MAGIC, BINARY_MAGIC_SIZE) == 0;
+}
+
+bool file_is_binary(const char *file_name) {
+    int fd = open_file(file_name, O_RDONLY);
+    bool is_binary = read_magic(fd);
+    close(fd);
+    return is_binary;
+}
+
+// A number split between two buffers is carried over to the next one. Longer
+// ones are not numbers anyway
+#define READ_CARRY_MAX 64
+
+struct read_buffer {
+    // READ_CARRY_MAX bytes before data are for the carried number, the data is
+    // followed by PARSE_PADDING zero bytes
+    char *base;
+    char *data;
+    size_t len;
+};
+
+struct int_reader {
+    int fd;
+    const char *name;
+    bool is_binary;
+    size_t buffer_size;
+    // The end of the file or of the numbers in it
+    bool is_done;
+    // Start of a number, which the previous buffer has ended with
+    char carry[READ_CARRY_MAX];
+    int carry_len;
+    // Numbers parsed from a text buffer
+    int *numbers;
+    // Buffer given out by the last int_reader_next()
+    struct read_buffer *cur;
+    struct read_buffer buffers[2];
+    // Buffers to read go to the reader coroutine, read ones come back. NULL
+    // outside of coroutines, the buffers are read right away then
+    struct coro_chan *full;
+    struct coro_chan *empty;
+    struct coro *coro;
+};
+
+// Fills the buffer up, only the last one of the file is shorter
+static void int_reader_fill(struct int_reader *r, struct read_buffer *buf) {
+    buf->len = 0;
+    while (buf->len < r->buffer_size) {
+        ssize_t rc = coro_read(r->fd, buf->data + buf->len, r->buffer_size - buf->len);
+        if (rc < 0) {
+            printf("Read from %s failed: %s\n", r->name, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if (rc == 0) break;
+        buf->len += (size_t) rc;
+    }
+    memset(buf->data + buf->len, 0, PARSE_PADDING);
+}
+
+static int int_reader_f(void *arg) {
+    struct int_reader *r = (struct int_reader *) arg;
+    void *msg;
+
+    while (coro_chan_recv(r->empty, &msg) == 0) {
+        struct read_buffer *buf = (struct read_buffer *) msg;
+        int_reader_fill(r, buf);
+        coro_chan_send(r->full, buf);
+        if (buf->len == 0) break;
+    }
+    return 0;
+}
+
+struct int_reader *int_reader_new(const char *file_name, size_t buffer_size) {
+    struct int_reader *r = (struct int_reader *) calloc(1, sizeof(*r));
+    r->fd = open_file(file_name, O_RDONLY);
+    r->name = file_name;
+    // Whole numbers in a binary buffer
+    r->buffer_size = buffer_size / sizeof(int) * sizeof(int);
+    if (r->buffer_size < IO_BUFFER_SIZE) r->buffer_size = IO_BUFFER_SIZE;
+
+    r->is_binary = read_magic(r->fd);
+    if (!r->is_binary) {
+        if (lseek(r->fd, 0, SEEK_SET) < 0) {
+            printf("Seek in %s failed: %s\n", file_name, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        // A number takes 2 bytes at least, with the separator
+        r->numbers = (int *) malloc(sizeof(int) * ((r->buffer_size + READ_CARRY_MAX) / 2 + 1));
+    }
+
+    int buffer_count = coro_this() != NULL ? 2 : 1;
+    for (int i = 0; i < buffer_count; i++) {
+        r->buffers[i].base = (char *) malloc(READ_CARRY_MAX + r->buffer_size + PARSE_PADDING);
+        r->buffers[i].data = r->buffers[i].base + READ_CARRY_MAX;
+    }
+
+    // Both buffers are read ahead right away
+    if (buffer_count == 2) {
+        r->full = coro_chan_new(2);
+        r->empty = coro_chan_new(2);
+        coro_chan_send(r->empty, &r->buffers[0]);
+        coro_chan_send(r->empty, &r->buffers[1]);
+        r->coro = coro_new_ex(int_reader_f, r, 64 * 1024);
+    }
+    return r;
+}
+
+bool int_reader_is_binary(const struct int_reader *r) {
+    return r->is_binary;
+}
+
+// Gives the last buffer back to the reader coroutine and takes the next one,
+// or reads it right away
+static struct read_buffer *int_reader_read(struct int_reader *r) {
+    if (r->coro == NULL) {
+        int_reader_fill(r, &r->buffers[0]);
+        return &r->buffers[0];
+    }
+
+    void *msg;
+    if (r->cur != NULL) coro_chan_send(r->empty, r->cur);
+    coro_chan_recv(r->full, &msg);
+    return (struct read_buffer *) msg;
+}
+
+int int_reader_next(struct int_reader *r, const int **arr) {
+    while (!r->is_done) {
+        struct read_buffer *buf = int_reader_read(r);
+        r->cur = buf;
+
+        if (r->is_binary) {
+            if (buf->len % sizeof(int) != 0) {
+                printf("Binary file %s is truncated\n", r->name);
+                exit(EXIT_FAILURE);
+            }
+            r->is_done = buf->len == 0;
+            *arr = (const int *) buf->data;
+            if (buf->len > 0) return (int) (buf->len / sizeof(int));
+            break;
+        }
+
+        // The carried start of a number goes right before the data. The last
+        // number of the data can go on in the next buffer - it is carried, if
+        // there are more
+        char *text = buf->data - r->carry_len;
+        memcpy(text, r->carry, r->carry_len);
+        char *end = buf->data + buf->len;
+        char *cut = end;
+        if (buf->len > 0) {
+            while (cut > text && !is_space(cut[-1])) cut--;
+            r->carry_len = (int) (end - cut);
+            if (r->carry_len > READ_CARRY_MAX) {
+                printf("Too long number in %s\n", r->name);
+                exit(EXIT_FAILURE);
+            }
+            memcpy(r->carry, cut, r->carry_len);
+        } else {
+            r->is_done = true;
+        }
+
+        const char *pos = text, *next;
+        int count = 0, value;
+        while ((next = parse_int(pos, cut, &value)) != NULL) {
+            r->numbers[count++] = value;
+            pos = next;
+            if (count % TEXT_YIELD_BLOCK == 0) text_yield_point();
+        }
+        // Something, which is not a number - the rest of the file is not
+        // read, like by fscanf()
+        while (is_space(*pos)) pos++;
+        if (pos < cut) r->is_done = true;
+
+        *arr = r->numbers;
+        if (count > 0) return count;
+    }
+    return 0;
+}
+
+void int_reader_delete(struct int_reader *r) {
+    if (r->coro != NULL) {
+        coro_chan_close(r->empty);
+        coro_join(r->coro, NULL);
+        coro_delete(r->coro);
+        coro_chan_delete(r->full);
+        coro_chan_delete(r->empty);
+    }
+
+    close(r->fd);
+    free(r->buffers[0].base);
+    free(r->buffers[1].base);
+    free(r->numbers);
+    free(r);
+}
+
+// The text is parsed by buffers as it is read, so it is never in the memory
+// whole - only the numbers are
+static void load_text(struct File *file) {
+    struct int_reader *r = int_reader_new(file->name, TEXT_LOAD_BUFFER_SIZE);
+    size_t capacity = 1024, len = 0;
+    int *arr = (int *) malloc(sizeof(int) * capacity);
+    const int *numbers;
+    int count;
+
+    while ((count = int_reader_next(r, &numbers)) > 0) {
+        if (len + count > capacity) {
+            while (len + count > capacity) capacity *= 2;
+            int *temp = (int *) realloc(arr, sizeof(int) * capacity);
+            if (temp == NULL) {
+                printf("Realloc failed: %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            arr = temp;
+        }
+        memcpy(arr + len, numbers, sizeof(int) * count);
+        len += count;
+    }
+    int_reader_delete(r);
+
+    file->arr = arr;
+    file->size = (int) len;
+    file->map = NULL;
+    file->map_size = 0;
+}
+
+// The numbers are used right where they are in the page cache. The pages are
+// populated right away - faults during sorting would block the whole thread
+static void load_binary(struct File *file, int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        printf("Stat of %s failed: %s\n", file->name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    size_t data_size = (size_t) st.st_size - BINARY_MAGIC_SIZE;
+    if (data_size % sizeof(int) != 0) {
+        printf("Binary file %s is truncated\n", file->name);
+        exit(EXIT_FAILURE);
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    if (map == MAP_FAILED) {
+        printf("Can't map %s: %s\n", file->name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    file->map = map;
+    file->map_size = st.st_size;
+    file->arr = (int *) ((char *) map + BINARY_MAGIC_SIZE);
+    file->size = (int) (data_size / sizeof(int));
+}
+
+void file_load(struct File *file) {
+    int fd = open_file(file->name, O_RDWR);
+
+    bool is_binary = read_magic(fd);
+    if (is_binary) load_binary(file, fd);
+    close(fd);
+    if (!is_binary) load_text(file);
+}
+
+void file_store(struct File *file) {
+    // Sorted in place in the page cache already
+    if (file->map != NULL) return;
+
+    write_to_file(file->name, file->arr, file->size, false);
+}
+
+void file_release(struct File *file) {
+    if (file->map != NULL) {
+        munmap(file->map, file->map_size);
+    } else {
+        free(file->arr);
+    }
+    file->arr = NULL;
+    file->map = NULL;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Binary files are this magic followed by native int32 numbers. Text files are
+// whitespace separated decimal numbers
+#define BINARY_MAGIC "BI32"
+#define BINARY_MAGIC_SIZE 4
+
+// Whether the file is in the binary format
+bool file_is_binary(const char *file_name);
+
+// Numbers of one file
+struct File {
+    int *arr;
+    const char *name;
+    int size;
+    // Mapping of a binary file, arr points into it. NULL for a text file, its
+    // numbers are malloc-ed
+    void *map;
+    size_t map_size;
+};
+
+// Loads the numbers of file->name in any of the formats. A binary file is
+// mapped shared, so sorting file->arr sorts the file itself, without parsing
+// and copying
+void file_load(struct File *file);
+
+// Makes the file contain file->arr. Only a text file has to be rewritten
+void file_store(struct File *file);
+
+// Frees the numbers or unmaps them
+void file_release(struct File *file);
+
+// Writes numbers into a new file in the given format, through large buffers.
+// Inside a coroutine a full buffer is written by a coroutine of the writer,
+// while the caller goes on filling the other one
+struct int_writer;
+
+struct int_writer *int_writer_new(const char *file_name, bool is_binary);
+
+// Writer of a part of a file, which starts at offset. The file is not
+// truncated, and no magic is written - that is for the writer of the start
+struct int_writer *int_writer_new_at(const char *file_name, bool is_binary, off_t offset);
+
+// Bytes the numbers take in the text format
+size_t int_text_size(const int *arr, int count);
+
+// Appends the numbers. arr can be reused right after the call
+void int_writer_put(struct int_writer *w, const int *arr, int count);
+
+// Writes out the rest, closes the file and frees the writer
+void int_writer_close(struct int_writer *w);
+
+// Writes the numbers into a new file in the given format
+void write_to_file(const char *file_name, const int *arr, int arr_size, bool is_binary);
+
+// Reads the numbers of a file in any of the formats one part after another,
+// through buffers of about buffer_size bytes. Inside a coroutine the next
+// buffer is read by a coroutine of the reader, while the caller handles the
+// current one
+struct int_reader;
+
+struct int_reader *int_reader_new(const char *file_name, size_t buffer_size);
+
+bool int_reader_is_binary(const struct int_reader *r);
+
+// Gives the next numbers of the file in *arr, returns how many - 0 at the end.
+// They are valid until the next call
+int int_reader_next(struct int_reader *r, const int **arr);
+
+void int_reader_delete(struct int_reader *r);
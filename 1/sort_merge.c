@@ -0,0 +1,324 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "libcoro.h"
+#include "sort_io.h"
+#include "sort_merge.h"
+
+// Merged numbers are handed to the writer by chunks, so the writing of one chunk
+// overlaps with the merging of the next ones
+#define MERGE_CHUNK_SIZE 4096
+
+// Merged pages of an array are given back by at least this many bytes, not to
+// make a syscall per page
+#define MERGE_RELEASE_SIZE (256 * 1024)
+
+// Heads are compared as 64 bit keys, an exhausted array has a key above any
+// int. So there is no sentinel among the ints, INT32_MAX is merged as any other
+#define KEY_EXHAUSTED INT64_MAX
+
+struct merge_source {
+    const int *pos;
+    const int *end;
+};
+
+struct merge_tree {
+    // Leaves, a power of two. The ones past the arrays are exhausted from start
+    int leaf_count;
+    // Inner nodes 1..leaf_count-1 keep the losers, node 0 - the winner
+    int *losers;
+    int64_t *keys;
+    struct merge_source *sources;
+    // Gives the next parts of the arrays of a stream merge, NULL otherwise
+    merge_refill_f refill;
+    void *refill_ctx;
+};
+
+static inline int64_t source_key(const struct merge_source *src) {
+    return src->pos < src->end ? *src->pos : KEY_EXHAUSTED;
+}
+
+static void merge_source_refill(struct merge_tree *t, int index) {
+    struct merge_source *src = &t->sources[index];
+    const int *arr = NULL;
+    int size = t->refill(t->refill_ctx, index, &arr);
+    src->pos = arr;
+    src->end = arr + size;
+}
+
+// Sets up the keys and the losers by the heads, the sources have
+static void merge_tree_build(struct merge_tree *t) {
+    int leaf_count = t->leaf_count;
+    for (int i = 0; i < leaf_count; i++) {
+        t->keys[i] = source_key(&t->sources[i]);
+    }
+
+    // Play the matches bottom-up. winners[n] is the winner at node n, the
+    // leaves are nodes leaf_count..2*leaf_count-1
+    int *winners = (int *) malloc(sizeof(int) * 2 * leaf_count);
+    for (int i = 0; i < leaf_count; i++) {
+        winners[leaf_count + i] = i;
+    }
+    for (int node = leaf_count - 1; node >= 1; node--) {
+        int a = winners[2 * node], b = winners[2 * node + 1];
+        int is_a_winner = t->keys[a] <= t->keys[b];
+        winners[node] = is_a_winner ? a : b;
+        t->losers[node] = is_a_winner ? b : a;
+    }
+    t->losers[0] = winners[1];
+    free(winners);
+}
+
+static struct merge_tree *merge_tree_alloc(int count) {
+    struct merge_tree *t = (struct merge_tree *) calloc(1, sizeof(*t));
+    int leaf_count = 1;
+    while (leaf_count < count) leaf_count *= 2;
+
+    t->leaf_count = leaf_count;
+    t->losers = (int *) malloc(sizeof(int) * leaf_count);
+    t->keys = (int64_t *) malloc(sizeof(int64_t) * leaf_count);
+    t->sources = (struct merge_source *) calloc(leaf_count, sizeof(struct merge_source));
+    return t;
+}
+
+struct merge_tree *merge_tree_new(const int *const *arrays, const int *sizes, int count) {
+    struct merge_tree *t = merge_tree_alloc(count);
+    for (int i = 0; i < count; i++) {
+        t->sources[i].pos = arrays[i];
+        t->sources[i].end = arrays[i] + sizes[i];
+    }
+    merge_tree_build(t);
+    return t;
+}
+
+struct merge_tree *merge_tree_new_stream(merge_refill_f refill, void *ctx, int count) {
+    struct merge_tree *t = merge_tree_alloc(count);
+    t->refill = refill;
+    t->refill_ctx = ctx;
+    for (int i = 0; i < count; i++) {
+        merge_source_refill(t, i);
+    }
+    merge_tree_build(t);
+    return t;
+}
+
+const int *merge_tree_position(const struct merge_tree *t, int index) {
+    return t->sources[index].pos;
+}
+
+void merge_tree_delete(struct merge_tree *t) {
+    free(t->losers);
+    free(t->keys);
+    free(t->sources);
+    free(t);
+}
+
+int merge_tree_next(struct merge_tree *t, int *out, int max_count) {
+    int *losers = t->losers;
+    int64_t *keys = t->keys;
+    int winner = losers[0];
+    int64_t key = keys[winner];
+    int count = 0;
+
+    while (count < max_count && key != KEY_EXHAUSTED) {
+        struct merge_source *src = &t->sources[winner];
+        out[count++] = (int) key;
+        src->pos++;
+        if (src->pos == src->end && t->refill != NULL) merge_source_refill(t, winner);
+        key = source_key(src);
+        keys[winner] = key;
+
+        // Replay the path of the winner. Both outcomes are selects, not
+        // branches - which way a match goes is random for random input
+        for (int node = (winner + t->leaf_count) / 2; node >= 1; node /= 2) {
+            int loser = losers[node];
+            int64_t loser_key = keys[loser];
+            int is_swapped = loser_key < key;
+            losers[node] = is_swapped ? winner : loser;
+            winner = is_swapped ? loser : winner;
+            key = is_swapped ? loser_key : key;
+        }
+    }
+
+    losers[0] = winner;
+    return count;
+}
+
+// Index of the first number in arr, which is not less (is_upper - greater) than v
+static int bound(const int *arr, int size, int64_t v, bool is_upper) {
+    int low = 0, high = size;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (arr[mid] < v || (is_upper && arr[mid] == v)) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+void merge_split(const int *const *arrays, const int *sizes, int count, long rank, int *split) {
+    // The smallest value, which has at least rank numbers not greater than it
+    int64_t low = INT_MIN, high = INT_MAX;
+    while (low < high) {
+        int64_t mid = (low + high) >> 1;
+        long not_greater = 0;
+        for (int i = 0; i < count; i++) {
+            not_greater += bound(arrays[i], sizes[i], mid, true);
+        }
+        if (not_greater >= rank) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+
+    // Everything less than it goes left, and as many equal ones as needed
+    long left = rank;
+    for (int i = 0; i < count; i++) {
+        split[i] = bound(arrays[i], sizes[i], low, false);
+        left -= split[i];
+    }
+    for (int i = 0; i < count && left > 0; i++) {
+        long equal = bound(arrays[i], sizes[i], low, true) - split[i];
+        long taken = equal < left ? equal : left;
+        split[i] += (int) taken;
+        left -= taken;
+    }
+}
+
+struct merge_part {
+    const int *const *arrays;
+    int count;
+    // Positions in the arrays, where the part begins and ends
+    const int *begin;
+    const int *end;
+    const char *file_name;
+    bool is_binary;
+    off_t offset;
+    // Bytes the part takes in the file
+    size_t size;
+};
+
+static int merge_part_size_f(void *arg) {
+    struct merge_part *part = (struct merge_part *) arg;
+    part->size = 0;
+    for (int i = 0; i < part->count; i++) {
+        int len = part->end[i] - part->begin[i];
+        if (part->is_binary) {
+            part->size += sizeof(int) * len;
+        } else {
+            part->size += int_text_size(part->arrays[i] + part->begin[i], len);
+        }
+    }
+    return 0;
+}
+
+// Gives back the whole pages between *released and pos, which are merged
+// already. The pages at the ends can hold numbers of the neighbour parts, they
+// are kept
+static void merge_release(const int **released, const int *pos, uintptr_t page_size) {
+    uintptr_t from = ((uintptr_t) *released + page_size - 1) & ~(page_size - 1);
+    uintptr_t to = (uintptr_t) pos & ~(page_size - 1);
+    if (to < from + MERGE_RELEASE_SIZE) return;
+
+    madvise((void *) from, to - from, MADV_DONTNEED);
+    *released = (const int *) to;
+}
+
+static int merge_part_f(void *arg) {
+    struct merge_part *part = (struct merge_part *) arg;
+    const int **arrays = (const int **) malloc(sizeof(int *) * part->count);
+    const int **released = (const int **) malloc(sizeof(int *) * part->count);
+    int *sizes = (int *) malloc(sizeof(int) * part->count);
+    int *result = (int *) malloc(sizeof(int) * MERGE_CHUNK_SIZE);
+    uintptr_t page_size = (uintptr_t) sysconf(_SC_PAGESIZE);
+    int len;
+
+    for (int i = 0; i < part->count; i++) {
+        arrays[i] = part->arrays[i] + part->begin[i];
+        released[i] = arrays[i];
+        sizes[i] = part->end[i] - part->begin[i];
+    }
+
+    struct int_writer *writer = int_writer_new_at(part->file_name, part->is_binary, part->offset);
+    struct merge_tree *tree = merge_tree_new(arrays, sizes, part->count);
+    while ((len = merge_tree_next(tree, result, MERGE_CHUNK_SIZE)) > 0) {
+        int_writer_put(writer, result, len);
+        for (int i = 0; i < part->count; i++) {
+            merge_release(&released[i], merge_tree_position(tree, i), page_size);
+        }
+    }
+    merge_tree_delete(tree);
+    int_writer_close(writer);
+
+    free(arrays);
+    free(released);
+    free(sizes);
+    free(result);
+    return 0;
+}
+
+// Runs f for each part in its own coroutine and waits for all of them
+static void merge_run_parts(coro_f f, struct merge_part *parts, int part_count) {
+    void **args = (void **) malloc(sizeof(void *) * part_count);
+    struct coro **coros = (struct coro **) malloc(sizeof(struct coro *) * part_count);
+    for (int p = 0; p < part_count; p++) {
+        args[p] = &parts[p];
+    }
+
+    coro_new_batch(f, args, part_count, coros);
+    for (int p = 0; p < part_count; p++) {
+        coro_join(coros[p], NULL);
+        coro_delete(coros[p]);
+    }
+    free(args);
+    free(coros);
+}
+
+void merge_to_file(const int *const *arrays, const int *sizes, int count, const char *file_name,
+                   bool is_binary, int part_count) {
+    long total = 0;
+    for (int i = 0; i < count; i++) {
+        total += sizes[i];
+    }
+    if (part_count < 1) part_count = 1;
+    if (part_count > total) part_count = total > 0 ? (int) total : 1;
+
+    // Part p is between the rows p and p + 1
+    int *splits = (int *) malloc(sizeof(int) * (part_count + 1) * (count > 0 ? count : 1));
+    for (int i = 0; i < count; i++) {
+        splits[i] = 0;
+        splits[part_count * count + i] = sizes[i];
+    }
+    for (int p = 1; p < part_count; p++) {
+        merge_split(arrays, sizes, count, total * p / part_count, splits + p * count);
+    }
+
+    struct merge_part *parts = (struct merge_part *) malloc(sizeof(struct merge_part) * part_count);
+    for (int p = 0; p < part_count; p++) {
+        parts[p] = (struct merge_part) {
+            .arrays = arrays, .count = count,
+            .begin = splits + p * count, .end = splits + (p + 1) * count,
+            .file_name = file_name, .is_binary = is_binary,
+        };
+    }
+
+    // Creates the file with the magic. The offsets of the parts are their
+    // sizes summed up, known only after formatting for the text
+    int_writer_close(int_writer_new(file_name, is_binary));
+    off_t offset = is_binary ? BINARY_MAGIC_SIZE : 0;
+    if (part_count > 1) merge_run_parts(merge_part_size_f, parts, part_count);
+    for (int p = 0; p < part_count; p++) {
+        parts[p].offset = offset;
+        offset += parts[p].size;
+    }
+    merge_run_parts(merge_part_f, parts, part_count);
+
+    free(parts);
+    free(splits);
+}
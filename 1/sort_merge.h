@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdbool.h>
+
+// K-way merge of sorted int arrays by a loser tree: a complete binary tree over
+// the heads of the arrays, where each inner node keeps the loser of the match
+// played there. Taking the smallest head and replaying its path to the root
+// costs log2(k) comparisons, no matter how many arrays there are
+struct merge_tree;
+
+// The arrays have to stay alive until the tree is deleted
+struct merge_tree *merge_tree_new(const int *const *arrays, const int *sizes, int count);
+
+// Gives the next part of the array index of a stream merge in *arr, returns its
+// size - 0 at the end of the array
+typedef int (*merge_refill_f)(void *ctx, int index, const int **arr);
+
+// Tree over count arrays, which come part by part. A part has to stay alive
+// until the next one of the same array is asked for
+struct merge_tree *merge_tree_new_stream(merge_refill_f refill, void *ctx, int count);
+
+void merge_tree_delete(struct merge_tree *t);
+
+// Position of the next number to merge in the array index
+const int *merge_tree_position(const struct merge_tree *t, int index);
+
+// Puts up to max_count next merged numbers into out. Returns how many, 0 when
+// all the arrays are merged
+int merge_tree_next(struct merge_tree *t, int *out, int max_count);
+
+// Positions in the arrays, which split off the rank smallest numbers of all of
+// them: all the numbers before the positions are not greater than the ones
+// after. Equal numbers are split in the order of the arrays
+void merge_split(const int *const *arrays, const int *sizes, int count, long rank, int *split);
+
+// Merges the arrays into a new file. The output is split into part_count
+// ranges of equal size by merge_split(), and each range is merged and written
+// by its own coroutine into its own byte range of the file - on different
+// threads in the multi-threaded mode. Works inside and outside of coroutines.
+// The pages of the arrays, which are merged already, are given back to the
+// system on the way, so the arrays can only be released after
+void merge_to_file(const int *const *arrays, const int *sizes, int count, const char *file_name,
+                   bool is_binary, int part_count);